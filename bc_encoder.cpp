@@ -0,0 +1,402 @@
+#include "bc_encoder.h"
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BC_SSE2 1
+#include <emmintrin.h>
+#endif
+
+bc_format bc_pick_format(int channels, bool normal_map){
+    if(normal_map)
+        return BC5;
+    switch(channels){
+        case 1:  return BC4;
+        case 2:  return BC5;
+        case 3:  return BC1;
+        default: return BC3;
+    }
+}
+
+unsigned int bc_block_bytes(bc_format format){
+    return (format == BC1 || format == BC4) ? 8 : 16;
+}
+
+size_t bc_image_bytes(bc_format format, int width, int height){
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * bc_block_bytes(format);
+}
+
+// 4*4 pixels as rgba, edges repeat the last row and column
+static void fetch_block(const unsigned char* data, int width, int height, int channels, int bx, int by, unsigned char px[16][4]){
+    for(int y=0; y<4; y++){
+        int sy = std::min(by * 4 + y, height - 1);
+        for(int x=0; x<4; x++){
+            int sx = std::min(bx * 4 + x, width - 1);
+            const unsigned char* p = data + ((size_t)sy * width + sx) * channels;
+            unsigned char* d = px[y * 4 + x];
+            d[0] = d[1] = d[2] = p[0];
+            d[3] = 255;
+            if(channels >= 3){
+                d[1] = p[1];
+                d[2] = p[2];
+            }
+            if(channels == 2 || channels == 4)
+                d[3] = p[channels - 1];
+        }
+    }
+}
+
+// ---- BC4, also the alpha of BC3 and both halves of BC5 ----
+
+static void bc4_palette(int e0, int e1, unsigned char pal[8]){
+    pal[0] = e0;
+    pal[1] = e1;
+    if(e0 > e1){
+        for(int i=1; i<7; i++)
+            pal[i + 1] = ((7 - i) * e0 + i * e1 + 3) / 7;
+    }else{
+        for(int i=1; i<5; i++)
+            pal[i + 1] = ((5 - i) * e0 + i * e1 + 2) / 5;
+        pal[6] = 0;
+        pal[7] = 255;
+    }
+}
+
+// nearest palette entry of every pixel, returns the squared error
+static unsigned int bc4_indices(const unsigned char v[16], const unsigned char pal[8], unsigned char idx[16]){
+    unsigned char dist[16];
+#if defined(BC_SSE2)
+    // all 16 pixels against one palette entry at a time
+    __m128i px = _mm_loadu_si128((const __m128i*)v);
+    __m128i best = _mm_set1_epi8((char)255), best_idx = _mm_setzero_si128();
+    for(int i=0; i<8; i++){
+        __m128i p = _mm_set1_epi8((char)pal[i]);
+        __m128i d = _mm_or_si128(_mm_subs_epu8(px, p), _mm_subs_epu8(p, px));
+        // ties keep the earlier entry
+        __m128i not_less = _mm_cmpeq_epi8(_mm_max_epu8(d, best), d);
+        best = _mm_min_epu8(best, d);
+        best_idx = _mm_or_si128(_mm_and_si128(not_less, best_idx), _mm_andnot_si128(not_less, _mm_set1_epi8((char)i)));
+    }
+    _mm_storeu_si128((__m128i*)dist, best);
+    _mm_storeu_si128((__m128i*)idx, best_idx);
+#else
+    for(int p=0; p<16; p++){
+        dist[p] = 255;
+        idx[p] = 0;
+        for(int i=0; i<8; i++){
+            int d = std::abs(v[p] - pal[i]);
+            if(d < dist[p]){
+                dist[p] = d;
+                idx[p] = i;
+            }
+        }
+    }
+#endif
+    unsigned int err = 0;
+    for(int p=0; p<16; p++)
+        err += dist[p] * dist[p];
+    return err;
+}
+
+static void bc4_write(unsigned char* out, int e0, int e1, const unsigned char idx[16]){
+    out[0] = e0;
+    out[1] = e1;
+    unsigned long long bits = 0;
+    for(int i=0; i<16; i++)
+        bits |= (unsigned long long)idx[i] << (3 * i);
+    for(int i=0; i<6; i++)
+        out[2 + i] = (bits >> (8 * i)) & 0xFF;
+}
+
+static void encode_bc4(const unsigned char v[16], bc_quality quality, unsigned char* out){
+    int lo = 255, hi = 0;
+    for(int i=0; i<16; i++){
+        lo = std::min<int>(lo, v[i]);
+        hi = std::max<int>(hi, v[i]);
+    }
+    unsigned char pal[8], idx[16];
+    // 8 value mode, flat blocks fall into the 6 value one with index 0
+    bc4_palette(hi, lo, pal);
+    unsigned int err = bc4_indices(v, pal, idx);
+
+    if(quality == BC_HIGH && err != 0){
+        // 6 values plus exact 0 and 255, wins when a few pixels sit at the extremes
+        int lo6 = 255, hi6 = 0;
+        for(int i=0; i<16; i++)
+            if(v[i] != 0 && v[i] != 255){
+                lo6 = std::min<int>(lo6, v[i]);
+                hi6 = std::max<int>(hi6, v[i]);
+            }
+        if(lo6 <= hi6){
+            unsigned char pal6[8], idx6[16];
+            bc4_palette(lo6, hi6, pal6);
+            if(bc4_indices(v, pal6, idx6) < err){
+                bc4_write(out, lo6, hi6, idx6);
+                return;
+            }
+        }
+    }
+    bc4_write(out, hi, lo, idx);
+}
+
+// ---- BC1, also the colour of BC3 ----
+
+static unsigned short pack565(const float c[3]){
+    int r = (int)(std::min(std::max(c[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    int g = (int)(std::min(std::max(c[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    int b = (int)(std::min(std::max(c[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return (r << 11) | (g << 5) | b;
+}
+
+static void unpack565(unsigned short c, int rgb[3]){
+    int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// 4 colour mode palette, needs c0 > c1
+static unsigned int bc1_indices(const unsigned char px[16][4], unsigned short c0, unsigned short c1, unsigned char idx[16]){
+    if(c0 == c1){
+        // 3 colour mode, index 3 would be transparent black
+        memset(idx, 0, 16);
+        int p[3];
+        unpack565(c0, p);
+        unsigned int err = 0;
+        for(int i=0; i<16; i++)
+            for(int c=0; c<3; c++)
+                err += (px[i][c] - p[c]) * (px[i][c] - p[c]);
+        return err;
+    }
+    int pal[4][3];
+    unpack565(c0, pal[0]);
+    unpack565(c1, pal[1]);
+    for(int c=0; c<3; c++){
+        pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+        pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+    }
+    unsigned int err = 0;
+    for(int i=0; i<16; i++){
+        unsigned int best = 0xFFFFFFFFu;
+        for(int k=0; k<4; k++){
+            int dr = px[i][0] - pal[k][0], dg = px[i][1] - pal[k][1], db = px[i][2] - pal[k][2];
+            unsigned int d = dr * dr + dg * dg + db * db;
+            if(d < best){
+                best = d;
+                idx[i] = k;
+            }
+        }
+        err += best;
+    }
+    return err;
+}
+
+static void bc1_write(unsigned char* out, unsigned short c0, unsigned short c1, const unsigned char idx[16]){
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    unsigned int bits = 0;
+    for(int i=0; i<16; i++)
+        bits |= (unsigned int)idx[i] << (2 * i);
+    for(int i=0; i<4; i++)
+        out[4 + i] = (bits >> (8 * i)) & 0xFF;
+}
+
+// quantizes both endpoints, orders them for 4 colour mode and picks indices
+static unsigned int bc1_fit(const unsigned char px[16][4], const float e0[3], const float e1[3],
+                            unsigned short &c0, unsigned short &c1, unsigned char idx[16]){
+    c0 = pack565(e0);
+    c1 = pack565(e1);
+    if(c0 < c1)
+        std::swap(c0, c1);
+    return bc1_indices(px, c0, c1, idx);
+}
+
+// endpoints minimizing the squared error for fixed indices
+static bool bc1_least_squares(const unsigned char px[16][4], const unsigned char idx[16], float e0[3], float e1[3]){
+    static const float weight0[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+    float aa = 0, bb = 0, ab = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+    for(int i=0; i<16; i++){
+        float a = weight0[idx[i]], b = 1.0f - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for(int c=0; c<3; c++){
+            ax[c] += a * px[i][c];
+            bx[c] += b * px[i][c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if(fabsf(det) < 1e-6f)
+        return false;
+    for(int c=0; c<3; c++){
+        e0[c] = (bb * ax[c] - ab * bx[c]) / det;
+        e1[c] = (aa * bx[c] - ab * ax[c]) / det;
+    }
+    return true;
+}
+
+static void encode_bc1(const unsigned char px[16][4], bc_quality quality, unsigned char* out){
+    float lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0}, mean[3] = {0, 0, 0};
+    for(int i=0; i<16; i++)
+        for(int c=0; c<3; c++){
+            lo[c] = std::min<float>(lo[c], px[i][c]);
+            hi[c] = std::max<float>(hi[c], px[i][c]);
+            mean[c] += px[i][c] / 16.0f;
+        }
+    float cov[6] = {0, 0, 0, 0, 0, 0};
+    for(int i=0; i<16; i++){
+        float r = px[i][0] - mean[0], g = px[i][1] - mean[1], b = px[i][2] - mean[2];
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+
+    float e0[3], e1[3];
+    if(quality == BC_FAST){
+        // box diagonal, channels running against the widest one are flipped
+        int widest = 0;
+        for(int c=1; c<3; c++)
+            if(hi[c] - lo[c] > hi[widest] - lo[widest])
+                widest = c;
+        static const int cov_of[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+        for(int c=0; c<3; c++){
+            // pull the endpoints in a little, the box corners overshoot
+            float inset = (hi[c] - lo[c]) / 16.0f;
+            e0[c] = hi[c] - inset;
+            e1[c] = lo[c] + inset;
+            if(cov[cov_of[widest][c]] < 0.0f)
+                std::swap(e0[c], e1[c]);
+        }
+    }else{
+        // principal axis by power iteration, endpoints at the extreme projections
+        float axis[3] = {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]};
+        for(int it=0; it<8; it++){
+            float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+            float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+            float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+            float len = std::max(fabsf(x), std::max(fabsf(y), fabsf(z)));
+            if(len < 1e-6f)
+                break;
+            axis[0] = x / len;
+            axis[1] = y / len;
+            axis[2] = z / len;
+        }
+        float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        float t_lo = 0, t_hi = 0;
+        if(len2 > 1e-6f){
+            t_lo = 1e30f;
+            t_hi = -1e30f;
+            for(int i=0; i<16; i++){
+                float t = ((px[i][0] - mean[0]) * axis[0] + (px[i][1] - mean[1]) * axis[1] + (px[i][2] - mean[2]) * axis[2]) / len2;
+                t_lo = std::min(t_lo, t);
+                t_hi = std::max(t_hi, t);
+            }
+        }
+        for(int c=0; c<3; c++){
+            e0[c] = mean[c] + axis[c] * t_hi;
+            e1[c] = mean[c] + axis[c] * t_lo;
+        }
+    }
+
+    unsigned short c0, c1;
+    unsigned char idx[16];
+    unsigned int err = bc1_fit(px, e0, e1, c0, c1, idx);
+    if(quality == BC_HIGH){
+        for(int it=0; it<2 && err != 0; it++){
+            float r0[3], r1[3];
+            if(!bc1_least_squares(px, idx, r0, r1))
+                break;
+            unsigned short n0, n1;
+            unsigned char n_idx[16];
+            unsigned int n_err = bc1_fit(px, r0, r1, n0, n1, n_idx);
+            if(n_err >= err)
+                break;
+            err = n_err;
+            c0 = n0;
+            c1 = n1;
+            memcpy(idx, n_idx, 16);
+        }
+    }
+    bc1_write(out, c0, c1, idx);
+}
+
+static void encode_block(const unsigned char px[16][4], int channels, bc_format format, bc_quality quality, unsigned char* out){
+    unsigned char v[16];
+    switch(format){
+        case BC1:
+            encode_bc1(px, quality, out);
+            break;
+        case BC3:
+            for(int i=0; i<16; i++)
+                v[i] = px[i][3];
+            encode_bc4(v, quality, out);
+            encode_bc1(px, quality, out + 8);
+            break;
+        case BC4:
+            for(int i=0; i<16; i++)
+                v[i] = px[i][0];
+            encode_bc4(v, quality, out);
+            break;
+        case BC5:
+            for(int i=0; i<16; i++)
+                v[i] = px[i][0];
+            encode_bc4(v, quality, out);
+            // second channel of a 2 channel image sits in alpha
+            for(int i=0; i<16; i++)
+                v[i] = channels == 2 ? px[i][3] : px[i][1];
+            encode_bc4(v, quality, out + 8);
+            break;
+    }
+}
+
+struct encode_job{
+    const unsigned char* data;
+    int width, height, channels;
+    bc_format format;
+    bc_quality quality;
+    unsigned char* out;
+};
+
+static void encode_rows(const encode_job &job, int by0, int by1){
+    int blocks_x = (job.width + 3) / 4;
+    unsigned int block_bytes = bc_block_bytes(job.format);
+    unsigned char px[16][4];
+    for(int by=by0; by<by1; by++)
+        for(int bx=0; bx<blocks_x; bx++){
+            fetch_block(job.data, job.width, job.height, job.channels, bx, by, px);
+            encode_block(px, job.channels, job.format, job.quality, job.out + ((size_t)by * blocks_x + bx) * block_bytes);
+        }
+}
+
+std::vector<unsigned char> bc_encode(const unsigned char* data, int width, int height, int channels,
+                                     bc_format format, bc_quality quality, unsigned int thread_cnt){
+    std::vector<unsigned char> out;
+    if(data == NULL || width <= 0 || height <= 0 || channels < 1 || channels > 4)
+        return out;
+    out.resize(bc_image_bytes(format, width, height));
+    if(thread_cnt == 0)
+        thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+
+    encode_job job = {data, width, height, channels, format, quality, out.data()};
+    int blocks_y = (height + 3) / 4;
+    unsigned int band_cnt = std::min<unsigned int>(thread_cnt, blocks_y);
+    if(band_cnt <= 1){
+        encode_rows(job, 0, blocks_y);
+        return out;
+    }
+    std::vector<std::thread> threads;
+    int band = (blocks_y + band_cnt - 1) / band_cnt;
+    for(int by=band; by<blocks_y; by+=band)
+        threads.emplace_back(encode_rows, std::cref(job), by, std::min(by + band, blocks_y));
+    encode_rows(job, 0, std::min(band, blocks_y));
+    for(std::thread &t : threads)
+        t.join();
+    return out;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+enum bc_format{
+    // rgb, 4 bits per pixel
+    BC1,
+    // rgb + alpha, 8 bits per pixel
+    BC3,
+    // one channel, 4 bits per pixel
+    BC4,
+    // two channels, 8 bits per pixel, used for normal maps
+    BC5
+};
+
+enum bc_quality{
+    // bounding box endpoints, cheap enough for loads at runtime
+    BC_FAST,
+    // principal axis endpoints refined by least squares and both BC4
+    // modes tried, for offline baking
+    BC_HIGH
+};
+
+// 1 channel -> BC4, 2 -> BC5, 3 -> BC1, 4 -> BC3, normal maps always BC5
+// from their x and y
+bc_format bc_pick_format(int channels, bool normal_map);
+// bytes of one 4*4 block
+unsigned int bc_block_bytes(bc_format format);
+// bytes of a whole image, partial blocks at the edges included
+size_t bc_image_bytes(bc_format format, int width, int height);
+
+// encodes an 8 bit image with 1 to 4 channels. Grey images feed rgb from
+// their first channel, the last channel of 2 and 4 channel images is alpha,
+// BC4 takes the first channel and BC5 the first two. Rows of blocks are
+// split over thread_cnt threads, 0 means one per hardware thread.
+std::vector<unsigned char> bc_encode(const unsigned char* data, int width, int height, int channels,
+                                     bc_format format, bc_quality quality, unsigned int thread_cnt = 1);
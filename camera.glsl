@@ -0,0 +1,10 @@
+// Camera block of every program, filled by camera_obj::update_uniform_buffer().
+// Include through shader_library or shader_batch, which expand #include.
+
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+    vec3 camera_pos;
+    float time;
+};
@@ -1,11 +1,16 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (std140) uniform Object {
+    mat4 model;
+    vec3 object_col;
+    // quantized positions decode as aPos * pos_scale + pos_offset
+    vec3 pos_scale;
+    vec3 pos_offset;
+};
+#include "camera.glsl"
 
 void main()
 {
-	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	gl_Position = view_projection * model * vec4(aPos * pos_scale + pos_offset, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,152 @@
+// Draws 100k lit cubes with light_basic: with a draw and an Object block
+// upload per cube, as one instanced draw, and with a draw per cube reading
+// an object_table_obj filled each frame, as meshes that differ would. Run
+// from the build dir like the main program.
+//
+//     instancing_bench [cubes] [frames]
+#include "opengl_helper.h"
+#include "mesh_helper.h"
+#include "vertex_layout.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+// per instance data of the INSTANCED permutation, locations 2 to 6
+struct cube_instance{
+    glm::mat4 model;
+    glm::vec3 col;
+};
+using instance_layout = vertex_layout<attr<transform, float4x4>, attr<color, float3>>;
+VERTEX_LAYOUT_CHECK(instance_layout, cube_instance);
+VERTEX_LAYOUT_MEMBER(instance_layout, cube_instance, 0, model);
+VERTEX_LAYOUT_MEMBER(instance_layout, cube_instance, 1, col);
+
+static const float cube_vertices[] = {
+    -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,   0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,   0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
+     0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,   0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,   0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,
+    -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,
+    -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,
+     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,   0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,   0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,
+     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,   0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,   0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,   0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,   0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,
+     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,
+    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,   0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,   0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f
+};
+
+// average ms a frame of draw_frame, from the first call to the GPU being done
+template<typename F>
+static double time_frames(GLFWwindow* window, unsigned int frames, F draw_frame){
+    // warm up, the driver may defer work to the first draws
+    draw_frame();
+    glFinish();
+    double beg = glfwGetTime();
+    for(unsigned int i=0; i<frames; i++){
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        draw_frame();
+        glfwSwapBuffers(window);
+    }
+    glFinish();
+    return (glfwGetTime() - beg) * 1000.0 / frames;
+}
+
+int main(int argc, char** argv){
+    unsigned int cube_cnt = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int frames = argc > 2 ? atoi(argv[2]) : 20;
+
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    GLFWwindow* window = glfwCreateWindow(1200, 600, "instancing_bench", NULL, NULL);
+    if(window == NULL){
+        printf("Failed to create Window\n");
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    if(!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)){
+        printf("Failed to init GLAD\n");
+        return -1;
+    }
+    // frames as fast as they go, no vsync
+    glfwSwapInterval(0);
+    glEnable(GL_DEPTH_TEST);
+
+    shader_library library("../light_basic.vs", "../light_basic.fs");
+    library.warm_up({{}, {"INSTANCED"}});
+    shader_obj &shader_plain = library.get({});
+    shader_obj &shader_instanced = library.get({"INSTANCED"});
+    shader_library table_library("../object_table.vs", "../light_basic.fs");
+    shader_obj &shader_table = table_library.get({"INSTANCED"});
+    uniform_handle base_h = shader_table.get_uniform_handle("object_base");
+    shader_table.use();
+    shader_table.blind_texture("object_table", 0);
+    for(int i=0; i<8; i++){
+        std::string key = "material_col[" + std::to_string(i) + "]";
+        shader_table.set_vec(key.c_str(), glm::vec3(i & 1, i >> 1 & 1, i >> 2 & 1) * 0.5f + 0.5f);
+    }
+    for(shader_obj* shader : {&shader_plain, &shader_instanced, &shader_table}){
+        shader->use();
+        shader->set_vec("light_col", 1.0f, 1.0f, 1.0f);
+        shader->set_vec("light_pos", 0.0f, 20.0f, 0.0f);
+    }
+
+    indexed_mesh mesh = weld_vertices(cube_vertices, 36, {3, 3});
+    optimize_mesh(mesh, "bench cube");
+    packed_mesh packed = quantize_mesh(mesh, {USAGE_POSITION, USAGE_NORMAL});
+    vertex_array_obj vao(packed, GL_STATIC_DRAW);
+
+    // a grid in front of the camera, one colour per column
+    std::vector<cube_instance> instances(cube_cnt);
+    unsigned int side = (unsigned int)ceil(cbrt((double)cube_cnt));
+    for(unsigned int i=0; i<cube_cnt; i++){
+        glm::vec3 cell(i % side, i / side % side, i / side / side);
+        glm::vec3 pos = (cell - glm::vec3(side * 0.5f, side * 0.5f, side)) * 1.5f;
+        instances[i].model = glm::scale(glm::translate(glm::mat4(1.0f), pos), glm::vec3(0.5f));
+        instances[i].col = cell / (float)side;
+    }
+    add_instances<instance_layout>(vao, instances, 2, GL_STATIC_DRAW);
+
+    camera_obj camera(2.0f, glm::vec3(0.0f, 0.0f, 10.0f));
+    camera.update_uniform_buffer(0.0f);
+    uniform_block_obj<object_block> object;
+    object.data.pos_scale = packed.pos_scale;
+    object.data.pos_offset = packed.pos_offset;
+
+    // what main does for a single cube, for every cube
+    double plain_ms = time_frames(window, frames, [&](){
+        shader_plain.use();
+        for(const cube_instance &instance : instances){
+            object.data.model = instance.model;
+            object.data.object_col = instance.col;
+            object.upload();
+            vao.draw_element(GL_TRIANGLES, vao.e_cnt);
+        }
+    });
+    double instanced_ms = time_frames(window, frames, [&](){
+        shader_instanced.use();
+        object.upload();
+        vao.draw_element_instanced(GL_TRIANGLES, vao.e_cnt, cube_cnt);
+    });
+
+    object_table_obj table(cube_cnt);
+    double table_ms = time_frames(window, frames, [&](){
+        table.clear();
+        for(unsigned int i=0; i<cube_cnt; i++)
+            table.add(instances[i].model, i % 8, packed.pos_scale, packed.pos_offset);
+        table.upload();
+        shader_table.use();
+        table.blind(0);
+        for(unsigned int i=0; i<cube_cnt; i++){
+            shader_table.set_int(base_h, i);
+            vao.draw_element(GL_TRIANGLES, vao.e_cnt);
+        }
+    });
+
+    printf("[Stat] %u cubes over %u frames: %.2f ms a frame with a draw each, %.2f ms instanced, %.1fx\n",
+            cube_cnt, frames, plain_ms, instanced_ms, plain_ms / instanced_ms);
+    printf("[Stat] %.2f ms a frame with a draw each from the object table, %.1fx\n", table_ms, plain_ms / table_ms);
+    glfwTerminate();
+    return 0;
+}
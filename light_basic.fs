@@ -2,11 +2,21 @@
 out vec4 FragColor;
 
 in vec3 Normal;  
-in vec3 frag_pos;  
+in vec3 FragPos;  
+// per instance colour, from the instance stream or object_table.vs
+#ifdef INSTANCED
+in vec3 InstanceCol;
+#endif
 
 uniform vec3 light_pos;
 uniform vec3 light_col;
-uniform vec3 object_col;
+layout (std140) uniform Object {
+    mat4 model;
+    vec3 object_col;
+    // quantized positions decode as aPos * pos_scale + pos_offset
+    vec3 pos_scale;
+    vec3 pos_offset;
+};
 
 void main()
 {
@@ -16,10 +26,14 @@ void main()
   	
     // diffuse 
     vec3 norm = normalize(Normal);
-    vec3 lightDir = normalize(light_pos - frag_pos);
+    vec3 lightDir = normalize(light_pos - FragPos);
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = diff * light_col;
     
+#ifdef INSTANCED
+    vec3 result = (ambient + diffuse) * InstanceCol;
+#else
     vec3 result = (ambient + diffuse) * object_col;
+#endif
     FragColor = vec4(result, 1.0);
 } 
\ No newline at end of file
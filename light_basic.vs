@@ -1,18 +1,35 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
+#ifdef INSTANCED
+// per instance, the model matrix takes locations 2 to 5
+layout (location = 2) in mat4 aModel;
+layout (location = 6) in vec3 aColor;
+out vec3 InstanceCol;
+#endif
 
 out vec3 FragPos;
 out vec3 Normal;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (std140) uniform Object {
+    mat4 model;
+    vec3 object_col;
+    // quantized positions decode as aPos * pos_scale + pos_offset
+    vec3 pos_scale;
+    vec3 pos_offset;
+};
+#include "camera.glsl"
 
 void main()
 {
-    FragPos = vec3(model * vec4(aPos, 1.0));
+#ifdef INSTANCED
+    mat4 world = aModel;
+    InstanceCol = aColor;
+#else
+    mat4 world = model;
+#endif
+    FragPos = vec3(world * vec4(aPos * pos_scale + pos_offset, 1.0));
     Normal = aNormal;  
     
-    gl_Position = projection * view * vec4(FragPos, 1.0);
+    gl_Position = view_projection * vec4(FragPos, 1.0);
 }
\ No newline at end of file
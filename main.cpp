@@ -1,5 +1,7 @@
 #include <iostream>
 #include "opengl_helper.h"
+#include "texture_helper.h"
+#include "mesh_helper.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -47,6 +49,7 @@ int main(int argc, char** argv){
 	printf("hello OpenGL\n");
     
     glfwInit();
+    double start_time = glfwGetTime();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
@@ -70,11 +73,21 @@ int main(int argc, char** argv){
     }
 
     //shader_obj shader("../vertex.vs", "../fragment.fs");
-    shader_obj shader_light("../light_basic.vs", "../light_basic.fs");
-    shader_obj shader_cube("../cube.vs", "../cube.fs");
-
-    texture_obj texture1("../resource/container.jpg", GL_RGB);
-    texture_obj texture2("../resource/awesomeface.png", GL_RGBA);
+    shader_obj shader_light, shader_cube;
+    shader_batch batch;
+    batch.add(shader_light, "../light_basic.vs", "../light_basic.fs");
+    batch.add(shader_cube, "../cube.vs", "../cube.fs");
+    batch.build();
+    printf("[Stat] Shader startup: %.2f ms, %u programs from binary cache, %u compiled\n",
+            shader_obj::startup.seconds * 1000.0, shader_obj::startup.cache_hit, shader_obj::startup.compiled);
+
+    // decoded in the background, uploaded by pump() in the render loop
+    texture_loader loader;
+    // BC1/BC3 by channel count, falls back to plain rgb without S3TC
+    loader.compress = true;
+    // no shader samples them yet, they only exercise the streaming stats
+    loader.load("../resource/container.jpg");
+    loader.load("../resource/awesomeface.png");
     
 
     float vertices[] = {
@@ -209,8 +222,21 @@ int main(int argc, char** argv){
         -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f
     };
 
-    vertex_array_obj vao_cube(36, {3}, vertices_cube, 0, NULL, GL_STATIC_DRAW);
-    vertex_array_obj vao_with_light(36, {3,3}, vertices_cube_with_normal, 0, NULL, GL_STATIC_DRAW);
+    // shared corners are stored once and drawn through 16 bit indices
+    indexed_mesh mesh_cube = weld_vertices(vertices_cube, 36, {3});
+    indexed_mesh mesh_with_light = weld_vertices(vertices_cube_with_normal, 36, {3,3});
+    printf("[Stat] Welded cubes: 36 -> %u and 36 -> %u vertices\n", mesh_cube.vertex_cnt(), mesh_with_light.vertex_cnt());
+    optimize_mesh(mesh_cube, "cube");
+    optimize_mesh(mesh_with_light, "lit cube");
+    // half positions within the bounds and 2_10_10_10 normals, 8 or 12 bytes a vertex
+    packed_mesh packed_cube = quantize_mesh(mesh_cube, {USAGE_POSITION});
+    packed_mesh packed_with_light = quantize_mesh(mesh_with_light, {USAGE_POSITION, USAGE_NORMAL});
+    printf("[Stat] Packed cube vertices: %u -> %u and %u -> %u bytes\n", mesh_cube.vertex_size * 4, packed_cube.stride,
+            mesh_with_light.vertex_size * 4, packed_with_light.stride);
+    vertex_array_obj vao_cube(packed_cube, GL_STATIC_DRAW);
+    // positions on their own too, for depth only passes
+    vertex_array_obj vao_with_light(packed_with_light, GL_STATIC_DRAW, true);
+    printf("[Stat] Depth pass fetches %u of %u bytes a vertex\n", packed_with_light.attribs[0].bytes(), packed_with_light.stride);
 
     // wire frame polygons
     //`glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -218,49 +244,81 @@ int main(int argc, char** argv){
 
 
     shader_light.use();
-    shader_light.set_vec("object_col", 1.0f, 0.5f, 0.31f);
     shader_light.set_vec("light_col",  1.0f, 1.0f, 1.0f);
     shader_light.set_vec("light_pos",  light_pos);
 
+    // per draw Object blocks, 64KB per frame is plenty for this scene
+    uniform_ring_obj object_ring(64 * 1024);
 
 
     glEnable(GL_DEPTH_TEST);
 
     // Render loop
+    bool first_frame = true;
     while(!glfwWindowShouldClose(window)){
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
+        shader_obj::new_frame();
 
         // key event
         processInput(window);
 
+        // at most 2ms of texture uploads per frame
+        loader.pump(2.0);
+
         // render
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear the depth buffer now!
         
         camera.calc_projection();
         camera.calc_view();
-        camera.model = glm::mat4(1.0f);
+        camera.update_uniform_buffer(currentFrame);
+
+        // write every draw's Object block first, then upload them at once
+        object_ring.begin_frame();
+        object_block obj;
+        obj.model = glm::mat4(1.0f);
+        obj.object_col = glm::vec3(1.0f, 0.5f, 0.31f);
+        obj.pos_scale = packed_with_light.pos_scale;
+        obj.pos_offset = packed_with_light.pos_offset;
+        unsigned int light_obj = object_ring.push(obj);
+        obj.model = glm::translate(glm::mat4(1.0f), light_pos);
+        obj.model = glm::scale(obj.model, glm::vec3(0.2f)); // a smaller cube
+        obj.object_col = glm::vec3(1.0f);
+        obj.pos_scale = packed_cube.pos_scale;
+        obj.pos_offset = packed_cube.pos_offset;
+        unsigned int lamp_obj = object_ring.push(obj);
+        object_ring.upload();
 
         shader_light.use();
-        camera.update_shader_uniform(shader_light, "view", "projection", "model");
-        vao_with_light.draw_array(GL_TRIANGLES, 0, 36);
+        if(object_ring.bind<object_block>(light_obj))
+            vao_with_light.draw_element(GL_TRIANGLES, vao_with_light.e_cnt);
 
         shader_cube.use();
-        glm::mat4 model = glm::translate(glm::mat4(1.0f), light_pos);
-        model = glm::scale(model, glm::vec3(0.2f)); // a smaller cube
-        camera.model = model;
-        camera.update_shader_uniform(shader_cube, "view", "projection", "model");
-        vao_cube.draw_array(GL_TRIANGLES, 0, 36);
+        if(object_ring.bind<object_block>(lamp_obj))
+            vao_cube.draw_element(GL_TRIANGLES, vao_cube.e_cnt);
+        object_ring.end_frame();
         
 
 
         // check event and swap buffer
         glfwPollEvents();
         glfwSwapBuffers(window);
+        if(first_frame){
+            // textures show their previews meanwhile, this must not grow with their size
+            printf("[Stat] First frame after %.1f ms, %u textures still loading\n",
+                    (glfwGetTime() - start_time) * 1000.0, loader.pending());
+            first_frame = false;
+        }
     }
     // release resources
+    printf("[Stat] Uniform lookups in last frame: %u cached, %u by driver\n",
+            shader_obj::frame_lookup.cached, shader_obj::frame_lookup.driver);
+    printf("[Stat] Uniform uploads in last frame: %u skipped, %u issued\n",
+            shader_obj::frame_upload.skipped, shader_obj::frame_upload.issued);
+    printf("[Stat] Texture memory: %.1f KB stored, %.1f KB as 8 bit pixels\n",
+            texture_obj::bytes_stored / 1024.0, texture_obj::bytes_uncompressed / 1024.0);
 
     glfwTerminate();
     return 0;
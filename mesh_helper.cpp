@@ -0,0 +1,491 @@
+#include "mesh_helper.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <glm/gtc/packing.hpp>
+
+static GLenum index_type_of(unsigned int vertex_cnt){
+    return vertex_cnt < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+unsigned int indexed_mesh::vertex_cnt() const{
+    return vertex_size == 0 ? 0 : vertices.size() / vertex_size;
+}
+
+GLenum indexed_mesh::index_type() const{
+    return index_type_of(vertex_cnt());
+}
+
+indexed_mesh weld_vertices(const float* vertex_data, unsigned int vertex_num,
+                           std::initializer_list<unsigned int> vertex_div, float epsilon){
+    indexed_mesh mesh;
+    mesh.vertex_div = vertex_div;
+    for(unsigned int item : vertex_div)
+        mesh.vertex_size += item;
+    unsigned int size = mesh.vertex_size;
+    if(size == 0 || vertex_num == 0)
+        return mesh;
+
+    // the words compared and hashed: float bits or grid cells
+    std::vector<long long> keys((size_t)vertex_num * size);
+    for(size_t i=0; i<keys.size(); i++){
+        if(epsilon > 0.0f)
+            keys[i] = std::llround(vertex_data[i] / epsilon);
+        else{
+            unsigned int bits;
+            memcpy(&bits, &vertex_data[i], sizeof(bits));
+            keys[i] = bits;
+        }
+    }
+
+    // open addressing, at most half full, slots hold first source vertices
+    unsigned int capacity = 1;
+    while(capacity < vertex_num * 2)
+        capacity <<= 1;
+    std::vector<unsigned int> table(capacity, 0xFFFFFFFFu);
+    std::vector<unsigned int> remap(vertex_num);
+    mesh.indices.resize(vertex_num);
+    for(unsigned int v=0; v<vertex_num; v++){
+        const long long* key = &keys[(size_t)v * size];
+        unsigned long long hash = 14695981039346656037ull;
+        for(unsigned int k=0; k<size; k++)
+            hash = (hash ^ (unsigned long long)key[k]) * 1099511628211ull;
+        unsigned int slot = (hash ^ (hash >> 32)) & (capacity - 1);
+        while(table[slot] != 0xFFFFFFFFu && memcmp(&keys[(size_t)table[slot] * size], key, size * sizeof(long long)) != 0)
+            slot = (slot + 1) & (capacity - 1);
+        if(table[slot] == 0xFFFFFFFFu){
+            table[slot] = v;
+            remap[v] = mesh.vertex_cnt();
+            mesh.vertices.insert(mesh.vertices.end(), vertex_data + (size_t)v * size, vertex_data + (size_t)(v + 1) * size);
+        }else
+            remap[v] = remap[table[slot]];
+        mesh.indices[v] = remap[v];
+    }
+    return mesh;
+}
+
+// FIFO post transform cache, true on a miss
+class fifo_cache{
+    public:
+        fifo_cache(unsigned int vertex_cnt, unsigned int size_):size(size_), stamp(vertex_cnt, 0){}
+        bool access(unsigned int v){
+            // a vertex is cached while fewer than size misses happened since its own
+            if(stamp[v] != 0 && misses - stamp[v] < size)
+                return false;
+            stamp[v] = ++misses;
+            return true;
+        }
+        void reset(){
+            misses += size;
+        }
+    private:
+        unsigned int size, misses = 0;
+        std::vector<unsigned int> stamp;
+};
+
+static glm::vec3 mesh_position(const indexed_mesh &mesh, unsigned int v){
+    const float* p = &mesh.vertices[(size_t)v * mesh.vertex_size];
+    return glm::vec3(p[0], p[1], p[2]);
+}
+
+static bool has_position(const indexed_mesh &mesh){
+    return !mesh.vertex_div.empty() && mesh.vertex_div[0] >= 3;
+}
+
+// draws every triangle in order with a depth test into a grid*grid target
+// from the 6 axis directions, counts pixels passing the test and covered
+static float measure_overdraw(const indexed_mesh &mesh, int grid = 256){
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for(unsigned int v=0; v<mesh.vertex_cnt(); v++){
+        lo = glm::min(lo, mesh_position(mesh, v));
+        hi = glm::max(hi, mesh_position(mesh, v));
+    }
+    glm::vec3 extent = glm::max(hi - lo, glm::vec3(1e-6f));
+    std::vector<float> depth((size_t)grid * grid);
+    unsigned long long shaded = 0, covered = 0;
+    for(int axis=0; axis<3; axis++)
+        for(int side=0; side<2; side++){
+            int ua = (axis + 1) % 3, va = (axis + 2) % 3;
+            std::fill(depth.begin(), depth.end(), 1e30f);
+            for(size_t t=0; t+2<mesh.indices.size(); t+=3){
+                float x[3], y[3], z[3];
+                for(int k=0; k<3; k++){
+                    glm::vec3 p = (mesh_position(mesh, mesh.indices[t + k]) - lo) / extent;
+                    x[k] = p[ua] * grid;
+                    y[k] = p[va] * grid;
+                    z[k] = side == 0 ? p[axis] : 1.0f - p[axis];
+                }
+                float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+                if(std::fabs(area) < 1e-12f)
+                    continue;
+                int x0 = std::max(0, (int)std::floor(std::min({x[0], x[1], x[2]})));
+                int x1 = std::min(grid - 1, (int)std::ceil(std::max({x[0], x[1], x[2]})));
+                int y0 = std::max(0, (int)std::floor(std::min({y[0], y[1], y[2]})));
+                int y1 = std::min(grid - 1, (int)std::ceil(std::max({y[0], y[1], y[2]})));
+                for(int py=y0; py<=y1; py++)
+                    for(int px=x0; px<=x1; px++){
+                        float cx = px + 0.5f, cy = py + 0.5f;
+                        float w0 = ((x[1] - cx) * (y[2] - cy) - (x[2] - cx) * (y[1] - cy)) / area;
+                        float w1 = ((x[2] - cx) * (y[0] - cy) - (x[0] - cx) * (y[2] - cy)) / area;
+                        float w2 = 1.0f - w0 - w1;
+                        if(w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                            continue;
+                        float d = w0 * z[0] + w1 * z[1] + w2 * z[2];
+                        float &stored = depth[(size_t)py * grid + px];
+                        if(stored == 1e30f)
+                            covered++;
+                        if(d < stored){
+                            stored = d;
+                            shaded++;
+                        }
+                    }
+            }
+        }
+    return covered == 0 ? 1.0f : (float)shaded / covered;
+}
+
+mesh_stats analyze_mesh(const indexed_mesh &mesh, unsigned int cache_size){
+    mesh_stats stats = {0.0f, 0.0f, 1.0f};
+    unsigned int tri_cnt = mesh.indices.size() / 3;
+    if(tri_cnt == 0)
+        return stats;
+    fifo_cache cache(mesh.vertex_cnt(), cache_size);
+    unsigned int misses = 0;
+    for(unsigned int i=0; i<tri_cnt*3; i++)
+        misses += cache.access(mesh.indices[i]);
+    stats.acmr = (float)misses / tri_cnt;
+    stats.atvr = (float)misses / mesh.vertex_cnt();
+    if(has_position(mesh))
+        stats.overdraw = measure_overdraw(mesh);
+    return stats;
+}
+
+void optimize_vertex_cache(indexed_mesh &mesh, unsigned int cache_size){
+    unsigned int vertex_cnt = mesh.vertex_cnt(), tri_cnt = mesh.indices.size() / 3;
+    if(tri_cnt == 0)
+        return;
+    // triangles of every vertex
+    std::vector<unsigned int> adj_beg(vertex_cnt + 1, 0), adj;
+    for(unsigned int i=0; i<tri_cnt*3; i++)
+        adj_beg[mesh.indices[i] + 1]++;
+    for(unsigned int v=0; v<vertex_cnt; v++)
+        adj_beg[v + 1] += adj_beg[v];
+    adj.resize(tri_cnt * 3);
+    std::vector<unsigned int> fill(adj_beg.begin(), adj_beg.end() - 1);
+    for(unsigned int i=0; i<tri_cnt*3; i++)
+        adj[fill[mesh.indices[i]]++] = i / 3;
+
+    std::vector<unsigned int> live(vertex_cnt), cache_time(vertex_cnt, 0);
+    for(unsigned int v=0; v<vertex_cnt; v++)
+        live[v] = adj_beg[v + 1] - adj_beg[v];
+    std::vector<bool> emitted(tri_cnt, false);
+    std::vector<unsigned int> dead_end, candidates, out;
+    out.reserve(tri_cnt * 3);
+    unsigned int time = cache_size + 1, cursor = 0;
+    int fan = mesh.indices[0];
+    while(fan >= 0){
+        candidates.clear();
+        for(unsigned int a=adj_beg[fan]; a<adj_beg[fan + 1]; a++){
+            unsigned int t = adj[a];
+            if(emitted[t])
+                continue;
+            emitted[t] = true;
+            for(int k=0; k<3; k++){
+                unsigned int v = mesh.indices[t * 3 + k];
+                out.push_back(v);
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if(time - cache_time[v] > cache_size)
+                    cache_time[v] = time++;
+            }
+        }
+        // the candidate with live triangles that is still cached after
+        // fanning around it and stayed longest
+        int best = -1, best_priority = -1;
+        for(unsigned int v : candidates){
+            if(live[v] == 0)
+                continue;
+            int priority = 0;
+            if(time - cache_time[v] + 2 * live[v] <= cache_size)
+                priority = time - cache_time[v];
+            if(priority > best_priority){
+                best = v;
+                best_priority = priority;
+            }
+        }
+        if(best < 0){
+            // recently used vertices first, then the lowest index left
+            while(!dead_end.empty() && best < 0){
+                unsigned int v = dead_end.back();
+                dead_end.pop_back();
+                if(live[v] > 0)
+                    best = v;
+            }
+            while(best < 0 && cursor < vertex_cnt){
+                if(live[cursor] > 0)
+                    best = cursor;
+                cursor++;
+            }
+        }
+        fan = best;
+    }
+    mesh.indices.swap(out);
+}
+
+void optimize_overdraw(indexed_mesh &mesh, float threshold, unsigned int cache_size){
+    unsigned int tri_cnt = mesh.indices.size() / 3;
+    if(tri_cnt == 0 || !has_position(mesh))
+        return;
+    // hard boundaries where the order jumps, a triangle missing all 3 vertices
+    std::vector<unsigned int> hard;
+    fifo_cache cache(mesh.vertex_cnt(), cache_size);
+    for(unsigned int t=0; t<tri_cnt; t++){
+        unsigned int misses = 0;
+        for(int k=0; k<3; k++)
+            misses += cache.access(mesh.indices[t * 3 + k]);
+        if(t == 0 || misses == 3)
+            hard.push_back(t);
+    }
+    hard.push_back(tri_cnt);
+
+    // soft boundaries inside, as soon as a piece is cheap enough on its own
+    std::vector<unsigned int> clusters;
+    for(unsigned int h=0; h+1<hard.size(); h++){
+        unsigned int beg = hard[h], end = hard[h + 1];
+        fifo_cache whole(mesh.vertex_cnt(), cache_size);
+        unsigned int misses = 0;
+        for(unsigned int i=beg*3; i<end*3; i++)
+            misses += whole.access(mesh.indices[i]);
+        float target = threshold * misses / (end - beg);
+        fifo_cache piece(mesh.vertex_cnt(), cache_size);
+        unsigned int start = beg;
+        misses = 0;
+        clusters.push_back(beg);
+        for(unsigned int t=beg; t<end; t++){
+            for(int k=0; k<3; k++)
+                misses += piece.access(mesh.indices[t * 3 + k]);
+            if(t + 1 < end && (float)misses / (t + 1 - start) <= target){
+                clusters.push_back(t + 1);
+                piece.reset();
+                start = t + 1;
+                misses = 0;
+            }
+        }
+    }
+    clusters.push_back(tri_cnt);
+
+    // clusters facing away from the mesh centre go first
+    glm::vec3 centre(0.0f);
+    float total_area = 0.0f;
+    struct cluster{
+        unsigned int beg, end;
+        float key;
+    };
+    std::vector<cluster> sorted;
+    std::vector<glm::vec3> centroids, normals;
+    for(unsigned int c=0; c+1<clusters.size(); c++){
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for(unsigned int t=clusters[c]; t<clusters[c + 1]; t++){
+            glm::vec3 p0 = mesh_position(mesh, mesh.indices[t * 3]);
+            glm::vec3 p1 = mesh_position(mesh, mesh.indices[t * 3 + 1]);
+            glm::vec3 p2 = mesh_position(mesh, mesh.indices[t * 3 + 2]);
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            float a = glm::length(n);
+            centroid += (p0 + p1 + p2) * (a / 3.0f);
+            normal += n;
+            area += a;
+        }
+        centre += centroid;
+        total_area += area;
+        centroids.push_back(area > 0.0f ? centroid / area : centroid);
+        float len = glm::length(normal);
+        normals.push_back(len > 0.0f ? normal / len : normal);
+        sorted.push_back(cluster{clusters[c], clusters[c + 1], 0.0f});
+    }
+    if(total_area > 0.0f)
+        centre /= total_area;
+    for(unsigned int c=0; c<sorted.size(); c++)
+        sorted[c].key = glm::dot(centroids[c] - centre, normals[c]);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const cluster &a, const cluster &b){
+        return a.key > b.key;
+    });
+    std::vector<unsigned int> out;
+    out.reserve(mesh.indices.size());
+    for(const cluster &c : sorted)
+        out.insert(out.end(), mesh.indices.begin() + c.beg * 3, mesh.indices.begin() + c.end * 3);
+    mesh.indices.swap(out);
+}
+
+void optimize_vertex_fetch(indexed_mesh &mesh){
+    unsigned int size = mesh.vertex_size;
+    std::vector<unsigned int> remap(mesh.vertex_cnt(), 0xFFFFFFFFu);
+    std::vector<float> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for(unsigned int &index : mesh.indices){
+        if(remap[index] == 0xFFFFFFFFu){
+            remap[index] = vertices.size() / size;
+            vertices.insert(vertices.end(), mesh.vertices.begin() + (size_t)index * size, mesh.vertices.begin() + (size_t)(index + 1) * size);
+        }
+        index = remap[index];
+    }
+    // vertices no triangle uses are dropped
+    mesh.vertices.swap(vertices);
+}
+
+void optimize_mesh(indexed_mesh &mesh, const char* name, unsigned int cache_size){
+    mesh_stats before = analyze_mesh(mesh, cache_size);
+    optimize_vertex_cache(mesh, cache_size);
+    optimize_overdraw(mesh, 1.05f, cache_size);
+    optimize_vertex_fetch(mesh);
+    mesh_stats after = analyze_mesh(mesh, cache_size);
+    printf("[Stat] Mesh %s: %zu tris, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overdraw %.3f -> %.3f\n", name,
+           mesh.indices.size() / 3, before.acmr, after.acmr, before.atvr, after.atvr, before.overdraw, after.overdraw);
+}
+
+GLenum vertex_attrib::gl_type() const{
+    switch(format){
+        case ATTRIB_HALF:
+            return GL_HALF_FLOAT;
+        case ATTRIB_SNORM_2_10_10_10:
+            return GL_INT_2_10_10_10_REV;
+        case ATTRIB_UNORM8:
+            return GL_UNSIGNED_BYTE;
+        default:
+            return GL_FLOAT;
+    }
+}
+
+bool vertex_attrib::normalized() const{
+    return format == ATTRIB_SNORM_2_10_10_10 || format == ATTRIB_UNORM8;
+}
+
+unsigned int vertex_attrib::bytes() const{
+    switch(format){
+        case ATTRIB_HALF:
+            return stored * 2;
+        case ATTRIB_SNORM_2_10_10_10:
+        case ATTRIB_UNORM8:
+            return 4;
+        default:
+            return stored * 4;
+    }
+}
+
+unsigned int packed_mesh::vertex_cnt() const{
+    return stride == 0 ? 0 : vertices.size() / stride;
+}
+
+GLenum packed_mesh::index_type() const{
+    return index_type_of(vertex_cnt());
+}
+
+packed_mesh pack_mesh(const indexed_mesh &mesh, const std::vector<attrib_usage> &usages,
+                      const std::vector<attrib_format> &formats){
+    packed_mesh packed;
+    packed.indices = mesh.indices;
+    std::vector<attrib_usage> usage(usages);
+    std::vector<attrib_format> format(formats);
+    usage.resize(mesh.vertex_div.size(), USAGE_OTHER);
+    format.resize(mesh.vertex_div.size(), ATTRIB_FLOAT);
+
+    // the first position is the one decoded with the bounds
+    int position = -1;
+    unsigned int src_offset = 0, pos_offset = 0;
+    for(unsigned int a=0; a<mesh.vertex_div.size(); a++){
+        vertex_attrib attrib;
+        attrib.format = format[a];
+        attrib.components = mesh.vertex_div[a];
+        attrib.stored = attrib.components;
+        // 10 bit fields take 3 or 4 components, bytes only come in 4
+        if(attrib.format == ATTRIB_SNORM_2_10_10_10 && attrib.components > 4)
+            attrib.format = ATTRIB_HALF;
+        if(attrib.format == ATTRIB_HALF)
+            attrib.stored = (attrib.components + 1) / 2 * 2;
+        else if(attrib.format != ATTRIB_FLOAT)
+            attrib.stored = 4;
+        attrib.offset = packed.stride;
+        packed.stride += attrib.bytes();
+        packed.attribs.push_back(attrib);
+        if(position < 0 && usage[a] == USAGE_POSITION && attrib.format != ATTRIB_FLOAT && attrib.components <= 3){
+            position = a;
+            pos_offset = src_offset;
+        }
+        src_offset += attrib.components;
+    }
+
+    unsigned int vertex_cnt = mesh.vertex_cnt();
+    if(position >= 0 && vertex_cnt > 0){
+        glm::vec3 lo(1e30f), hi(-1e30f);
+        for(unsigned int v=0; v<vertex_cnt; v++)
+            for(unsigned int c=0; c<packed.attribs[position].components; c++){
+                float val = mesh.vertices[(size_t)v * mesh.vertex_size + pos_offset + c];
+                lo[c] = std::min(lo[c], val);
+                hi[c] = std::max(hi[c], val);
+            }
+        for(unsigned int c=packed.attribs[position].components; c<3; c++)
+            lo[c] = hi[c] = 0.0f;
+        packed.pos_offset = (lo + hi) * 0.5f;
+        packed.pos_scale = glm::max((hi - lo) * 0.5f, glm::vec3(1e-20f));
+    }
+
+    packed.vertices.resize((size_t)vertex_cnt * packed.stride);
+    for(unsigned int v=0; v<vertex_cnt; v++){
+        const float* src = &mesh.vertices[(size_t)v * mesh.vertex_size];
+        unsigned char* dst = &packed.vertices[(size_t)v * packed.stride];
+        for(unsigned int a=0; a<packed.attribs.size(); a++){
+            const vertex_attrib &attrib = packed.attribs[a];
+            // padding of positions and colours is 1, of the rest 0
+            glm::vec4 val(0.0f, 0.0f, 0.0f, usage[a] == USAGE_POSITION || usage[a] == USAGE_COLOR ? 1.0f : 0.0f);
+            for(unsigned int c=0; c<attrib.components && c<4; c++)
+                val[c] = src[c];
+            if((int)a == position)
+                val = glm::vec4((glm::vec3(val) - packed.pos_offset) / packed.pos_scale, 1.0f);
+            unsigned char* out = dst + attrib.offset;
+            if(attrib.format == ATTRIB_FLOAT)
+                memcpy(out, src, attrib.bytes());
+            else if(attrib.format == ATTRIB_HALF){
+                for(unsigned int c=0; c<attrib.stored; c++){
+                    unsigned short half = glm::packHalf1x16(c < 4 ? val[c] : (c < attrib.components ? src[c] : 0.0f));
+                    memcpy(out + c * 2, &half, 2);
+                }
+            }else if(attrib.format == ATTRIB_SNORM_2_10_10_10){
+                // w only has -1, 0 and 1, enough for a tangent's handedness
+                glm::vec3 xyz(val);
+                float len = glm::length(xyz);
+                if((usage[a] == USAGE_NORMAL || usage[a] == USAGE_TANGENT) && len > 0.0f)
+                    xyz /= len;
+                unsigned int bits = glm::packSnorm3x10_1x2(glm::vec4(xyz, val.w));
+                memcpy(out, &bits, 4);
+            }else{
+                unsigned int bits = glm::packUnorm4x8(val);
+                memcpy(out, &bits, 4);
+            }
+            src += attrib.components;
+        }
+    }
+    return packed;
+}
+
+packed_mesh quantize_mesh(const indexed_mesh &mesh, const std::vector<attrib_usage> &usages){
+    std::vector<attrib_format> formats;
+    for(attrib_usage usage : usages){
+        switch(usage){
+            case USAGE_POSITION:
+            case USAGE_UV:
+                formats.push_back(ATTRIB_HALF);
+                break;
+            case USAGE_NORMAL:
+            case USAGE_TANGENT:
+                formats.push_back(ATTRIB_SNORM_2_10_10_10);
+                break;
+            case USAGE_COLOR:
+                formats.push_back(ATTRIB_UNORM8);
+                break;
+            default:
+                formats.push_back(ATTRIB_FLOAT);
+        }
+    }
+    return pack_mesh(mesh, usages, formats);
+}
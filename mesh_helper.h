@@ -0,0 +1,108 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include <vector>
+
+// Vertices and triangle list indices with the float layout vertex_array_obj
+// takes, see weld_vertices().
+struct indexed_mesh{
+    // floats per attribute and per vertex
+    std::vector<unsigned int> vertex_div;
+    unsigned int vertex_size = 0;
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+
+    unsigned int vertex_cnt() const;
+    // GL_UNSIGNED_SHORT below 65536 vertices, GL_UNSIGNED_INT above
+    GLenum index_type() const;
+};
+
+// Turns a raw vertex stream (every 3 vertices a triangle, or any list drawn
+// with glDrawArrays) into unique vertices and indices. Vertices are welded
+// when all their floats are bit identical, or with epsilon > 0 when every
+// float snaps to the same multiple of epsilon. The first vertex of a group
+// is kept, the order of first use is preserved.
+indexed_mesh weld_vertices(const float* vertex_data, unsigned int vertex_num,
+                           std::initializer_list<unsigned int> vertex_div, float epsilon = 0.0f);
+
+// What a triangle order costs, measured on the CPU
+struct mesh_stats{
+    // post transform cache misses per triangle and per vertex of a FIFO
+    // cache, 0.5 and 1.0 are the best possible
+    float acmr, atvr;
+    // shaded / visible pixels over 6 axis aligned views, 1.0 is no overdraw
+    float overdraw;
+};
+
+// Triangle lists only. cache_size is the FIFO simulated, overdraw needs the
+// position as the first attribute
+mesh_stats analyze_mesh(const indexed_mesh &mesh, unsigned int cache_size = 16);
+// Tipsify (Sander et al. 2007): fans around the vertex that stays in the
+// cache longest, jumps to a dead end vertex when none is left
+void optimize_vertex_cache(indexed_mesh &mesh, unsigned int cache_size = 16);
+// splits the cache friendly order into clusters that cost at most threshold
+// times its ACMR, then draws the clusters facing outwards first so they hide
+// the rest from any view, front faces are counter clockwise
+void optimize_overdraw(indexed_mesh &mesh, float threshold = 1.05f, unsigned int cache_size = 16);
+// renumbers vertices in order of first use so fetches walk the VBO forwards
+void optimize_vertex_fetch(indexed_mesh &mesh);
+// all three in order, prints the stats before and after
+void optimize_mesh(indexed_mesh &mesh, const char* name, unsigned int cache_size = 16);
+
+// How one vertex attribute is stored in a packed_mesh
+enum attrib_format{
+    ATTRIB_FLOAT,
+    // 16 bit float, padded to an even number of components
+    ATTRIB_HALF,
+    // normalized GL_INT_2_10_10_10_REV, xyz in 10 bits, w in 2
+    ATTRIB_SNORM_2_10_10_10,
+    // normalized GL_UNSIGNED_BYTE, padded to 4 components
+    ATTRIB_UNORM8
+};
+
+// What an attribute holds, quantize_mesh() picks the format from it
+enum attrib_usage{
+    USAGE_POSITION,
+    USAGE_NORMAL,
+    // xyz and the handedness in w
+    USAGE_TANGENT,
+    USAGE_UV,
+    USAGE_COLOR,
+    USAGE_OTHER
+};
+
+struct vertex_attrib{
+    attrib_format format;
+    // components in the source and as stored after padding
+    unsigned int components, stored;
+    // bytes from the start of the vertex
+    unsigned int offset;
+
+    GLenum gl_type() const;
+    bool normalized() const;
+    unsigned int bytes() const;
+};
+
+// Vertices of mixed attribute formats, every attribute 4 byte aligned
+struct packed_mesh{
+    std::vector<vertex_attrib> attribs;
+    unsigned int stride = 0;
+    std::vector<unsigned char> vertices;
+    std::vector<unsigned int> indices;
+    // a quantized position decodes as stored * pos_scale + pos_offset in the
+    // vertex shader, see the Object block
+    glm::vec3 pos_scale = glm::vec3(1.0f), pos_offset = glm::vec3(0.0f);
+
+    unsigned int vertex_cnt() const;
+    // GL_UNSIGNED_SHORT below 65536 vertices, GL_UNSIGNED_INT above
+    GLenum index_type() const;
+};
+
+// Packs every attribute of the mesh in the given format. A non float
+// position is stored relative to the mesh bounds, in [-1, 1].
+packed_mesh pack_mesh(const indexed_mesh &mesh, const std::vector<attrib_usage> &usages,
+                      const std::vector<attrib_format> &formats);
+// Same with the format picked by usage: half positions within the bounds
+// and uvs, 2_10_10_10 normals and tangents (w keeps the sign), 8 bit
+// colours, float for anything else.
+packed_mesh quantize_mesh(const indexed_mesh &mesh, const std::vector<attrib_usage> &usages);
@@ -0,0 +1,117 @@
+// Times the CPU mip chain builder against its scalar reference.
+//
+//     mipmap_bench [image files...]
+//
+// Without arguments the images in ../resource/ are used. Every image is run
+// as R8, RGB8 and RGBA8. The SIMD, threaded and sRGB results must match
+// their scalar single threaded references bit for bit, and normal maps must
+// average as stored, the exit code is 1 when one does not.
+#include "mipmap_gen.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+static const int repeat_cnt = 20;
+
+// best of repeat_cnt runs in ms
+static double time_build(const unsigned char* data, int width, int height, int channels, const mip_options &opt, mip_chain &chain){
+    double best = 1e30;
+    for(int i=0; i<repeat_cnt; i++){
+        auto start = std::chrono::steady_clock::now();
+        chain = build_mip_chain(data, width, height, channels, opt);
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        if(took.count() < best)
+            best = took.count();
+    }
+    return best;
+}
+
+static bool same_chain(const mip_chain &a, const mip_chain &b){
+    if(a.levels.size() != b.levels.size())
+        return false;
+    for(size_t i=0; i<a.levels.size(); i++)
+        if(a.levels[i].pixels != b.levels[i].pixels)
+            return false;
+    return true;
+}
+
+// a normal map as the loaders mip it: flat (128,128,255) texels stay flat
+// and green alternating 64/192 averages to 128, not to its sRGB mean
+static bool normal_map_linear(){
+    std::vector<unsigned char> data;
+    for(int i=0; i<16; i++){
+        data.push_back(128);
+        data.push_back(i % 2 ? 64 : 192);
+        data.push_back(255);
+    }
+    mip_options opt;
+    opt.srgb = mip_srgb(3, true);
+    mip_chain chain = build_mip_chain(data.data(), 4, 4, 3, opt);
+    const std::vector<unsigned char> &level = chain.levels[0].pixels;
+    for(size_t i=0; i<level.size(); i+=3)
+        if(level[i] != 128 || level[i + 1] != 128 || level[i + 2] != 255){
+            printf("[Stat] Normal map level 1 texel (%d,%d,%d), not (128,128,255)  MISMATCH normal\n",
+                   level[i], level[i + 1], level[i + 2]);
+            return false;
+        }
+    return true;
+}
+
+int main(int argc, char** argv){
+    std::vector<const char*> files;
+    for(int i=1; i<argc; i++)
+        files.push_back(argv[i]);
+    if(files.empty()){
+        files.push_back("../resource/container.jpg");
+        files.push_back("../resource/awesomeface.png");
+    }
+    unsigned int thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+    printf("[Stat] Mip builder: %s, %u threads, best of %d runs\n", mip_simd_name(), thread_cnt, repeat_cnt);
+
+    bool all_match = normal_map_linear();
+    for(const char* file_name : files){
+        for(int channels : {1, 3, 4}){
+            int width, height, file_ch;
+            unsigned char* data = stbi_load(file_name, &width, &height, &file_ch, channels);
+            if(data == NULL){
+                printf("[File ERROR] Fail to load %s\n", file_name);
+                break;
+            }
+            mip_options scalar;
+            scalar.simd = false;
+            scalar.thread_cnt = 1;
+            mip_options simd = scalar;
+            simd.simd = true;
+            mip_options threaded = simd;
+            threaded.thread_cnt = thread_cnt;
+            mip_options srgb_scalar = scalar;
+            srgb_scalar.srgb = true;
+            mip_options srgb = threaded;
+            srgb.srgb = true;
+
+            mip_chain ref, fast, banded, srgb_ref, srgb_fast;
+            double t_scalar = time_build(data, width, height, channels, scalar, ref);
+            double t_simd = time_build(data, width, height, channels, simd, fast);
+            double t_threaded = time_build(data, width, height, channels, threaded, banded);
+            double t_srgb_scalar = time_build(data, width, height, channels, srgb_scalar, srgb_ref);
+            double t_srgb = time_build(data, width, height, channels, srgb, srgb_fast);
+            // each output must not depend on the path that built it
+            const char* mismatch = !same_chain(ref, fast) ? "  MISMATCH simd"
+                                 : !same_chain(fast, banded) ? "  MISMATCH threaded"
+                                 : !same_chain(srgb_ref, srgb_fast) ? "  MISMATCH srgb" : "";
+            all_match = all_match && mismatch[0] == 0;
+
+            const char* base = strrchr(file_name, '/');
+            printf("[Stat] %s %d*%d %dch: scalar %.3fms, simd %.3fms (%.1fx), simd*%u %.3fms (%.1fx), "
+                   "srgb scalar %.3fms, srgb simd*%u %.3fms (%.1fx)%s\n",
+                   base ? base + 1 : file_name, width, height, channels, t_scalar, t_simd, t_scalar / t_simd,
+                   thread_cnt, t_threaded, t_scalar / t_threaded, t_srgb_scalar, thread_cnt, t_srgb,
+                   t_srgb_scalar / t_srgb, mismatch);
+            stbi_image_free(data);
+        }
+    }
+    return all_match ? 0 : 1;
+}
@@ -0,0 +1,437 @@
+#include "mipmap_gen.h"
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIP_SSE2 1
+#include <emmintrin.h>
+#endif
+// AVX2 is compiled per function and picked at runtime, gcc and clang only
+#if defined(MIP_SSE2) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MIP_AVX2 1
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// levels smaller than this are not worth a thread
+static const size_t min_thread_bytes = 64 * 1024;
+
+// the second half of each table keeps alpha linear, so alpha bytes only
+// need an offset instead of a branch
+static const int alpha_linear = 256, alpha_srgb = 4096;
+
+struct srgb_tables{
+    float to_linear[256 + 256];
+    // indexed by linear * 4095, alpha by its rounded value
+    unsigned char to_srgb[4096 + 256];
+    // the same as ints for a gather
+    int to_srgb32[4096 + 256];
+
+    srgb_tables(){
+        for(int i=0; i<256; i++){
+            float c = i / 255.0f;
+            to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            to_linear[alpha_linear + i] = (float)i;
+            to_srgb[alpha_srgb + i] = (unsigned char)i;
+        }
+        for(int i=0; i<4096; i++){
+            float l = i / 4095.0f;
+            float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+            to_srgb[i] = (unsigned char)(c * 255.0f + 0.5f);
+        }
+        for(int i=0; i<4096 + 256; i++)
+            to_srgb32[i] = to_srgb[i];
+    }
+};
+
+static const srgb_tables& get_srgb_tables(){
+    static const srgb_tables tables;
+    return tables;
+}
+
+enum simd_level{ SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+static simd_level detect_simd(){
+#if defined(MIP_AVX2)
+    if(__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+#if defined(MIP_SSE2)
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+static simd_level cpu_simd(){
+    static const simd_level level = detect_simd();
+    return level;
+}
+
+const char* mip_simd_name(){
+    switch(cpu_simd()){
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE2: return "sse2";
+        default:        return "scalar";
+    }
+}
+
+// one level built from the previous one
+struct level_job{
+    const unsigned char* src;
+    int src_w, src_h;
+    unsigned char* dst;
+    int dst_w, dst_h;
+    int channels;
+    bool srgb;
+    simd_level simd;
+};
+
+#if defined(MIP_SSE2)
+// returns the output pixels written, only full 2*2 quads are handled
+static int row_sse2(const unsigned char* r0, const unsigned char* r1, unsigned char* out, int pairs, int channels){
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    if(channels == 4){
+        const __m128i two = _mm_set1_epi16(2);
+        // 4 source pixels -> 2
+        for(; x + 2 <= pairs; x += 2){
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0 + x * 8));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r1 + x * 8));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+            hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+            __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+            _mm_storel_epi64((__m128i*)(out + x * 4), _mm_packus_epi16(sum, sum));
+        }
+    }else if(channels == 1){
+        const __m128i ones = _mm_set1_epi16(1), two = _mm_set1_epi32(2);
+        // 16 source pixels -> 8, madd adds the horizontal neighbours
+        for(; x + 8 <= pairs; x += 8){
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0 + x * 2));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r1 + x * 2));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            lo = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(lo, ones), two), 2);
+            hi = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(hi, ones), two), 2);
+            __m128i sum = _mm_packs_epi32(lo, hi);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(sum, sum));
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(MIP_AVX2)
+// same as row_sse2 with twice the width, packs work per 128 bit lane so the
+// results are gathered with a final permute
+AVX2_TARGET static int row_avx2(const unsigned char* r0, const unsigned char* r1, unsigned char* out, int pairs, int channels){
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+    if(channels == 4){
+        const __m256i two = _mm256_set1_epi16(2);
+        for(; x + 4 <= pairs; x += 4){
+            __m256i a = _mm256_loadu_si256((const __m256i*)(r0 + x * 8));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(r1 + x * 8));
+            __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+            __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+            lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+            hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+            __m256i sum = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), two), 2);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0x08);
+            _mm_storeu_si128((__m128i*)(out + x * 4), _mm256_castsi256_si128(packed));
+        }
+    }else if(channels == 1){
+        const __m256i ones = _mm256_set1_epi16(1), two = _mm256_set1_epi32(2);
+        for(; x + 16 <= pairs; x += 16){
+            __m256i a = _mm256_loadu_si256((const __m256i*)(r0 + x * 2));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(r1 + x * 2));
+            __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+            __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+            lo = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(lo, ones), two), 2);
+            hi = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(hi, ones), two), 2);
+            __m256i sum = _mm256_packs_epi32(lo, hi);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0x08);
+            _mm_storeu_si128((__m128i*)(out + x), _mm256_castsi256_si128(packed));
+        }
+    }
+    return x;
+}
+#endif
+
+// sRGB outputs average the to_linear values of their quad as
+// (top left + bottom left) + (top right + bottom right), then index to_srgb
+// with the average scaled by 4095, alpha by itself in the linear half of
+// the tables. The SIMD rows do the same float operations as the scalar
+// loop, so they match bit for bit. A block holds the outputs of whole
+// pixels that fill whole vectors: 3 channels take 3 vectors.
+struct srgb_block{
+    int values;
+    // per value: top left source byte from the block start, to_linear
+    // offset, index scale and to_srgb offset
+    int src[24], lin[24], out[24];
+    float scale[24];
+
+    srgb_block(int ch, int width){
+        values = ch == 3 ? 3 * width : width;
+        for(int v=0; v<values; v++){
+            int c = v % ch;
+            bool alpha = (ch == 2 || ch == 4) && c == ch - 1;
+            src[v] = 2 * (v / ch) * ch + c;
+            lin[v] = alpha ? alpha_linear : 0;
+            out[v] = alpha ? alpha_srgb : 0;
+            scale[v] = alpha ? 1.0f : 4095.0f;
+        }
+    }
+};
+
+#if defined(MIP_SSE2)
+// returns the output pixels written, only full 2*2 quads are handled, the
+// lookups stay scalar without a gather
+static int srgb_row_sse2(const unsigned char* r0, const unsigned char* r1, unsigned char* out, int pairs, int ch,
+                         const srgb_tables &tables){
+    const srgb_block block(ch, 4);
+    const int per = block.values / ch;
+    const __m128 quarter = _mm_set1_ps(0.25f), half = _mm_set1_ps(0.5f);
+    alignas(16) float lin[4][4];
+    alignas(16) int idx[4];
+    int x = 0;
+    for(; x + per <= pairs; x += per){
+        const unsigned char* s0 = r0 + x * 2 * ch;
+        const unsigned char* s1 = r1 + x * 2 * ch;
+        for(int v=0; v<block.values; v+=4){
+            for(int j=0; j<4; j++){
+                int src = block.src[v + j], offset = block.lin[v + j];
+                lin[0][j] = tables.to_linear[s0[src] + offset];
+                lin[1][j] = tables.to_linear[s1[src] + offset];
+                lin[2][j] = tables.to_linear[s0[src + ch] + offset];
+                lin[3][j] = tables.to_linear[s1[src + ch] + offset];
+            }
+            __m128 left = _mm_add_ps(_mm_load_ps(lin[0]), _mm_load_ps(lin[1]));
+            __m128 right = _mm_add_ps(_mm_load_ps(lin[2]), _mm_load_ps(lin[3]));
+            __m128 l = _mm_mul_ps(_mm_add_ps(left, right), quarter);
+            __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(l, _mm_loadu_ps(block.scale + v)), half));
+            _mm_store_si128((__m128i*)idx, _mm_add_epi32(i, _mm_loadu_si128((const __m128i*)(block.out + v))));
+            unsigned char* dst = out + x * ch + v;
+            for(int j=0; j<4; j++)
+                dst[j] = tables.to_srgb[idx[j]];
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(MIP_AVX2)
+// 8 source bytes at offsets below 32 from p, widened to ints
+AVX2_TARGET static inline __m256i srgb_pick(const unsigned char* p, const char* lo_mask, const char* hi_mask){
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), _mm_load_si128((const __m128i*)lo_mask));
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), _mm_load_si128((const __m128i*)hi_mask));
+    return _mm256_cvtepu8_epi32(_mm_or_si128(lo, hi));
+}
+
+// same with the source bytes shuffled out of two loads a vector and
+// to_linear gathered
+AVX2_TARGET static int srgb_row_avx2(const unsigned char* r0, const unsigned char* r1, unsigned char* out, int pairs,
+                                     int ch, int src_n, const srgb_tables &tables){
+    const srgb_block block(ch, 8);
+    const int per = block.values / ch, vectors = block.values / 8;
+    // per vector: where its loads start, shuffle masks of the left and
+    // right bytes out of the first and second load, 0x80 clears a byte
+    int start[3];
+    alignas(16) char masks[3][4][16];
+    for(int v=0; v<vectors; v++){
+        start[v] = block.src[v * 8];
+        for(int j=0; j<16; j++)
+            for(int m=0; m<4; m++)
+                masks[v][m][j] = (char)0x80;
+        for(int j=0; j<8; j++)
+            for(int side=0; side<2; side++){
+                int offset = block.src[v * 8 + j] - start[v] + side * ch;
+                masks[v][side * 2 + (offset >= 16)][j] = (char)(offset & 15);
+            }
+    }
+    const __m256 quarter = _mm256_set1_ps(0.25f), half = _mm256_set1_ps(0.5f);
+    int x = 0;
+    // both loads of the last vector stay inside the row
+    for(; x + per <= pairs && x * 2 * ch + start[vectors - 1] + 32 <= src_n; x += per){
+        const unsigned char* s0 = r0 + x * 2 * ch;
+        const unsigned char* s1 = r1 + x * 2 * ch;
+        for(int v=0; v<vectors; v++){
+            __m256i offset = _mm256_loadu_si256((const __m256i*)(block.lin + v * 8));
+            __m256i tl = _mm256_add_epi32(srgb_pick(s0 + start[v], masks[v][0], masks[v][1]), offset);
+            __m256i bl = _mm256_add_epi32(srgb_pick(s1 + start[v], masks[v][0], masks[v][1]), offset);
+            __m256i tr = _mm256_add_epi32(srgb_pick(s0 + start[v], masks[v][2], masks[v][3]), offset);
+            __m256i br = _mm256_add_epi32(srgb_pick(s1 + start[v], masks[v][2], masks[v][3]), offset);
+            __m256 left = _mm256_add_ps(_mm256_i32gather_ps(tables.to_linear, tl, 4), _mm256_i32gather_ps(tables.to_linear, bl, 4));
+            __m256 right = _mm256_add_ps(_mm256_i32gather_ps(tables.to_linear, tr, 4), _mm256_i32gather_ps(tables.to_linear, br, 4));
+            __m256 l = _mm256_mul_ps(_mm256_add_ps(left, right), quarter);
+            __m256i i = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(l, _mm256_loadu_ps(block.scale + v * 8)), half));
+            i = _mm256_add_epi32(i, _mm256_loadu_si256((const __m256i*)(block.out + v * 8)));
+            __m256i srgb = _mm256_i32gather_epi32(tables.to_srgb32, i, 4);
+            __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(srgb), _mm256_extracti128_si256(srgb, 1));
+            _mm_storel_epi64((__m128i*)(out + x * ch + v * 8), _mm_packus_epi16(packed, packed));
+        }
+    }
+    return x;
+}
+#endif
+
+static void filter_rows_srgb(const level_job &job, int y0, int y1){
+    const int ch = job.channels;
+    const int alpha = (ch == 2 || ch == 4) ? ch - 1 : -1;
+    const srgb_tables &tables = get_srgb_tables();
+    const int src_n = job.src_w * ch;
+    const int pairs = std::min(job.dst_w, job.src_w / 2);
+
+    for(int y=y0; y<y1; y++){
+        const unsigned char* r0 = job.src + (size_t)(2 * y) * src_n;
+        const unsigned char* r1 = job.src + (size_t)std::min(2 * y + 1, job.src_h - 1) * src_n;
+        unsigned char* out = job.dst + (size_t)y * job.dst_w * ch;
+        int x = 0;
+#if defined(MIP_AVX2)
+        if(job.simd == SIMD_AVX2)
+            x = srgb_row_avx2(r0, r1, out, pairs, ch, src_n, tables);
+#endif
+#if defined(MIP_SSE2)
+        if(job.simd != SIMD_NONE)
+            x += srgb_row_sse2(r0 + x * 2 * ch, r1 + x * 2 * ch, out + x * ch, pairs - x, ch, tables);
+#endif
+        // scalar reference and tail, odd sizes repeat the last column
+        for(; x<job.dst_w; x++){
+            int x0 = 2 * x * ch, x1 = std::min(2 * x + 1, job.src_w - 1) * ch;
+            for(int c=0; c<ch; c++){
+                int offset = c == alpha ? alpha_linear : 0;
+                float left = tables.to_linear[r0[x0 + c] + offset] + tables.to_linear[r1[x0 + c] + offset];
+                float right = tables.to_linear[r0[x1 + c] + offset] + tables.to_linear[r1[x1 + c] + offset];
+                float l = (left + right) * 0.25f;
+                if(c == alpha)
+                    out[x * ch + c] = tables.to_srgb[(int)(l * 1.0f + 0.5f) + alpha_srgb];
+                else
+                    out[x * ch + c] = tables.to_srgb[(int)(l * 4095.0f + 0.5f)];
+            }
+        }
+    }
+}
+
+static void filter_rows(const level_job &job, int y0, int y1){
+    if(job.srgb){
+        filter_rows_srgb(job, y0, y1);
+        return;
+    }
+    const int ch = job.channels;
+    const size_t src_stride = (size_t)job.src_w * ch, dst_stride = (size_t)job.dst_w * ch;
+    // outputs whose 2*2 quad lies fully inside the source
+    const int pairs = std::min(job.dst_w, job.src_w / 2);
+
+    for(int y=y0; y<y1; y++){
+        const unsigned char* r0 = job.src + (size_t)(2 * y) * src_stride;
+        const unsigned char* r1 = job.src + (size_t)std::min(2 * y + 1, job.src_h - 1) * src_stride;
+        unsigned char* out = job.dst + (size_t)y * dst_stride;
+        int x = 0;
+#if defined(MIP_AVX2)
+        if(job.simd == SIMD_AVX2)
+            x = row_avx2(r0, r1, out, pairs, ch);
+#endif
+#if defined(MIP_SSE2)
+        if(job.simd != SIMD_NONE){
+            int done = row_sse2(r0 + x * 2 * ch, r1 + x * 2 * ch, out + x * ch, pairs - x, ch);
+            x += done;
+        }
+#endif
+        // scalar reference and tail, odd sizes repeat the last column
+        for(; x<job.dst_w; x++){
+            int x0 = 2 * x, x1 = std::min(2 * x + 1, job.src_w - 1);
+            for(int c=0; c<ch; c++){
+                int a = r0[x0 * ch + c], b = r0[x1 * ch + c], d = r1[x0 * ch + c], e = r1[x1 * ch + c];
+                out[x * ch + c] = (unsigned char)((a + b + d + e + 2) >> 2);
+            }
+        }
+    }
+}
+
+static void filter_level(const level_job &job, unsigned int thread_cnt){
+    size_t bytes = (size_t)job.dst_w * job.dst_h * job.channels;
+    unsigned int band_cnt = std::min<unsigned int>(thread_cnt, job.dst_h);
+    if(band_cnt <= 1 || bytes < min_thread_bytes){
+        filter_rows(job, 0, job.dst_h);
+        return;
+    }
+    std::vector<std::thread> threads;
+    int band = (job.dst_h + band_cnt - 1) / band_cnt;
+    for(int y=band; y<job.dst_h; y+=band)
+        threads.emplace_back(filter_rows, std::cref(job), y, std::min(y + band, job.dst_h));
+    filter_rows(job, 0, std::min(band, job.dst_h));
+    for(std::thread &t : threads)
+        t.join();
+}
+
+static float alpha_coverage(const unsigned char* pixels, size_t pixel_cnt, int channels, float ref, float scale){
+    size_t covered = 0;
+    for(size_t i=0; i<pixel_cnt; i++)
+        if(pixels[i * channels + channels - 1] * scale > ref * 255.0f)
+            covered++;
+    return (float)covered / pixel_cnt;
+}
+
+// scales alpha so its coverage matches the base level
+static void keep_alpha_coverage(mip_level &level, int channels, float ref, float coverage){
+    size_t pixel_cnt = (size_t)level.width * level.height;
+    float lo = 0.0f, hi = 4.0f;
+    for(int i=0; i<10; i++){
+        float mid = (lo + hi) * 0.5f;
+        if(alpha_coverage(level.pixels.data(), pixel_cnt, channels, ref, mid) < coverage)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    float scale = (lo + hi) * 0.5f;
+    for(size_t i=0; i<pixel_cnt; i++){
+        unsigned char &a = level.pixels[i * channels + channels - 1];
+        a = (unsigned char)std::min(255.0f, a * scale + 0.5f);
+    }
+}
+
+mip_chain build_mip_chain(const unsigned char* data, int width, int height, int channels, const mip_options &opt){
+    mip_chain chain;
+    chain.channels = channels;
+    if(data == NULL || width <= 0 || height <= 0 || channels < 1 || channels > 4)
+        return chain;
+    unsigned int thread_cnt = opt.thread_cnt;
+    if(thread_cnt == 0)
+        thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+
+    level_job job;
+    job.src = data;
+    job.src_w = width;
+    job.src_h = height;
+    job.channels = channels;
+    job.srgb = opt.srgb;
+    job.simd = opt.simd ? cpu_simd() : SIMD_NONE;
+    while(job.src_w > 1 || job.src_h > 1){
+        chain.levels.push_back(mip_level());
+        mip_level &level = chain.levels.back();
+        level.width = std::max(1, job.src_w / 2);
+        level.height = std::max(1, job.src_h / 2);
+        level.pixels.resize((size_t)level.width * level.height * channels);
+
+        job.dst = level.pixels.data();
+        job.dst_w = level.width;
+        job.dst_h = level.height;
+        filter_level(job, thread_cnt);
+
+        // the next level filters the unscaled alpha
+        job.src = level.pixels.data();
+        job.src_w = level.width;
+        job.src_h = level.height;
+    }
+
+    bool has_alpha = channels == 2 || channels == 4;
+    if(has_alpha && opt.alpha_ref > 0.0f){
+        float coverage = alpha_coverage(data, (size_t)width * height, channels, opt.alpha_ref, 1.0f);
+        for(mip_level &level : chain.levels)
+            keep_alpha_coverage(level, channels, opt.alpha_ref, coverage);
+    }
+    return chain;
+}
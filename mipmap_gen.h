@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+struct mip_level{
+    int width, height;
+    std::vector<unsigned char> pixels;
+};
+
+// levels below a base image, levels[0] is half the base size, the last 1*1
+struct mip_chain{
+    int channels = 0;
+    std::vector<mip_level> levels;
+};
+
+struct mip_options{
+    // average colour channels in linear light, alpha always stays linear
+    bool srgb = false;
+    // keep the share of alpha above this reference the same in every level
+    // so alpha tested edges don't thin out, 0 disables
+    float alpha_ref = 0.0f;
+    // rows of a level are split over this many threads, 0 means one per
+    // hardware thread
+    unsigned int thread_cnt = 0;
+    // false forces the scalar reference path
+    bool simd = true;
+};
+
+// whether the mips of a texture average in linear light: colour images do,
+// normal maps hold vectors and average as stored
+inline bool mip_srgb(int channels, bool normal_map){
+    return channels >= 3 && !normal_map;
+}
+
+// 2*2 box filtered mip chain of an 8 bit image with 1 to 4 channels, the
+// last channel of 2 and 4 channel images is alpha. SSE2/AVX2 cover linear
+// R8 and RGBA8 and sRGB averaging of every channel count, everything else
+// runs the scalar path.
+mip_chain build_mip_chain(const unsigned char* data, int width, int height, int channels,
+                          const mip_options &opt = mip_options());
+
+// fast path picked on this cpu: "avx2", "sse2" or "scalar"
+const char* mip_simd_name();
@@ -0,0 +1,31 @@
+// Per object data of object_table_obj, set up by object_table_obj::blind().
+// Include through shader_library, which expands #include.
+
+uniform samplerBuffer object_table;
+// row of the draw's first instance
+uniform int object_base;
+
+int object_row()
+{
+    return (object_base + gl_InstanceID) * 7;
+}
+
+// includes the decode of quantized positions
+mat4 object_model()
+{
+    int row = object_row();
+    return mat4(texelFetch(object_table, row), texelFetch(object_table, row + 1),
+                texelFetch(object_table, row + 2), texelFetch(object_table, row + 3));
+}
+
+mat3 object_normal_matrix()
+{
+    int row = object_row() + 4;
+    return mat3(texelFetch(object_table, row).xyz, texelFetch(object_table, row + 1).xyz,
+                texelFetch(object_table, row + 2).xyz);
+}
+
+int object_material()
+{
+    return int(texelFetch(object_table, object_row() + 4).w);
+}
@@ -0,0 +1,23 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+
+// with light_basic.fs and INSTANCED, the colour comes from the material
+out vec3 FragPos;
+out vec3 Normal;
+out vec3 InstanceCol;
+
+#include "object_table.glsl"
+#include "camera.glsl"
+
+// colour of each material id
+uniform vec3 material_col[8];
+
+void main()
+{
+    FragPos = vec3(object_model() * vec4(aPos, 1.0));
+    Normal = object_normal_matrix() * aNormal;
+    InstanceCol = material_col[object_material()];
+
+    gl_Position = view_projection * vec4(FragPos, 1.0);
+}
@@ -1,100 +1,785 @@
 #include "opengl_helper.h"
+#include "texture_helper.h"
+#include "mipmap_gen.h"
+#include "mesh_helper.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <algorithm>
 #include <glm/gtc/type_ptr.hpp>
+#ifdef _WIN32
+#include <direct.h>
+#define MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define MKDIR(path) mkdir(path, 0755)
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-shader_obj::shader_obj(const char* vertex_shader_path, const char* fragment_shader_path){
-    std::string vertexCode;
-    std::string fragmentCode;
-    std::ifstream vShaderFile;
-    std::ifstream fShaderFile;
+static std::string read_shader_file(const char* path){
+    std::ifstream file;
     // 保证ifstream对象可以抛出异常：
-    vShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
-    fShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+    file.exceptions (std::ifstream::failbit | std::ifstream::badbit);
     try 
     {
-        // 打开文件
-        vShaderFile.open(vertex_shader_path);
-        fShaderFile.open(fragment_shader_path);
-        std::stringstream vShaderStream, fShaderStream;
-        // 读取文件的缓冲内容到数据流中
-        vShaderStream << vShaderFile.rdbuf();
-        fShaderStream << fShaderFile.rdbuf();       
-        // 关闭文件处理器
-        vShaderFile.close();
-        fShaderFile.close();
-        // 转换数据流到string
-        vertexCode   = vShaderStream.str();
-        fragmentCode = fShaderStream.str();     
+        std::stringstream stream;
+        file.open(path);
+        stream << file.rdbuf();
+        file.close();
+        return stream.str();
     }
     catch(std::ifstream::failure e)
     {
-        std::cout << "[File ERROR] Fail to open shader file" << std::endl;
+        std::cout << "[File ERROR] Fail to open shader file " << path << std::endl;
+    }
+    return "";
+}
+
+// replace every #include "file" line, files already in included are skipped
+static void expand_includes(const std::string &path, std::vector<std::string> &included, std::string &out){
+    for(const std::string &inc : included)
+        if(inc == path)
+            return;
+    included.push_back(path);
+    std::string dir = path.substr(0, path.find_last_of("/\\") + 1);
+    std::istringstream src(read_shader_file(path.c_str()));
+    std::string line;
+    while(std::getline(src, line)){
+        size_t pos = line.find_first_not_of(" \t");
+        if(pos != std::string::npos && line.compare(pos, 8, "#include") == 0){
+            size_t beg = line.find('"', pos + 8);
+            size_t end = beg == std::string::npos ? beg : line.find('"', beg + 1);
+            if(end == std::string::npos){
+                printf("[Shader ERROR] Bad include in %s: %s\n", path.c_str(), line.c_str());
+                continue;
+            }
+            expand_includes(dir + line.substr(beg + 1, end - beg - 1), included, out);
+            continue;
+        }
+        out += line;
+        out += '\n';
     }
-    const char* vShaderCode = vertexCode.c_str();
-    const char* fShaderCode = fragmentCode.c_str();
-    // 2. compile shaders
+}
+
+static unsigned long long fnv1a_64(const char* data, size_t len, unsigned long long h = 14695981039346656037ull){
+    for(size_t i=0; i<len; i++)
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    return h;
+}
+
+shader_obj::shader_obj():program_id(0), vertex_id(0), fragment_id(0){
+}
+
+shader_obj::shader_obj(const char* vertex_shader_path, const char* fragment_shader_path){
+    shader_batch batch;
+    batch.add(*this, vertex_shader_path, fragment_shader_path);
+    batch.build();
+}
+
+void shader_obj::begin_compile(const char* vShaderCode, const char* fShaderCode){
     // vertex shader
     vertex_id = glCreateShader(GL_VERTEX_SHADER);
     glShaderSource(vertex_id, 1, &vShaderCode, NULL);
     glCompileShader(vertex_id);
-    check_compile_errors(vertex_id, "VERTEX");
     // fragment Shader
     fragment_id = glCreateShader(GL_FRAGMENT_SHADER);
     glShaderSource(fragment_id, 1, &fShaderCode, NULL);
     glCompileShader(fragment_id);
-    check_compile_errors(fragment_id, "FRAGMENT");
+}
+
+void shader_obj::begin_link(){
     // shader Program
     program_id = glCreateProgram();
     glAttachShader(program_id, vertex_id);
     glAttachShader(program_id, fragment_id);
+    if(GLAD_GL_ARB_get_program_binary)
+        glProgramParameteri(program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(program_id);
+}
+
+void shader_obj::end_compile(){
+    check_compile_errors(vertex_id, "VERTEX");
+    check_compile_errors(fragment_id, "FRAGMENT");
     check_compile_errors(program_id, "PROGRAM");
     // delete the shaders as they're linked into our program now and no longer necessary
     glDeleteShader(vertex_id);
     glDeleteShader(fragment_id);
 }
 
+void shader_batch::add(shader_obj& shader, const char* vertex_shader_path, const char* fragment_shader_path){
+    std::string vertex_code, fragment_code;
+    std::vector<std::string> included;
+    expand_includes(vertex_shader_path, included, vertex_code);
+    included.clear();
+    expand_includes(fragment_shader_path, included, fragment_code);
+    add_source(shader, vertex_code, fragment_code, "");
+}
+
+void shader_batch::add_source(shader_obj& shader, const std::string &vertex_code, const std::string &fragment_code, const std::string &defines){
+    entry e;
+    e.shader = &shader;
+    e.vertex_code = vertex_code;
+    e.fragment_code = fragment_code;
+    e.defines = defines;
+    e.key = 0;
+    e.from_cache = false;
+    entries.push_back(e);
+}
+
+void shader_batch::build(){
+    submit();
+    finish();
+}
+
+void shader_batch::submit(){
+    beg_time = glfwGetTime();
+    if(shader_obj::binary_cache_available()){
+        for(entry &e : entries){
+            e.key = shader_obj::binary_cache_key(e.vertex_code, e.fragment_code, e.defines);
+            e.from_cache = e.shader->load_binary(e.key);
+        }
+    }
+    // let the driver pick how many compiler threads to use
+    if(GLAD_GL_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    for(entry &e : entries)
+        if(!e.from_cache)
+            e.shader->begin_compile(e.vertex_code.c_str(), e.fragment_code.c_str());
+    for(entry &e : entries)
+        if(!e.from_cache)
+            e.shader->begin_link();
+}
+
+bool shader_batch::is_ready() const{
+    if(!GLAD_GL_KHR_parallel_shader_compile)
+        return true;
+    for(const entry &e : entries){
+        if(e.from_cache)
+            continue;
+        int done = 0;
+        glGetProgramiv(e.shader->program_id, GL_COMPLETION_STATUS_KHR, &done);
+        if(!done)
+            return false;
+    }
+    return true;
+}
+
+void shader_batch::finish(){
+    for(entry &e : entries){
+        if(e.from_cache){
+            shader_obj::startup.cache_hit++;
+        }else{
+            e.shader->end_compile();
+            if(e.key != 0)
+                e.shader->save_binary(e.key);
+            shader_obj::startup.compiled++;
+        }
+        e.shader->collect_uniforms();
+        e.shader->bind_uniform_blocks();
+    }
+    shader_obj::startup.seconds += glfwGetTime() - beg_time;
+    entries.clear();
+}
+
+// whole word search, so "USE_FOG" does not match "USE_FOG_HEIGHT"
+static bool mentions(const std::string &code, const std::string &name){
+    for(size_t pos = code.find(name); pos != std::string::npos; pos = code.find(name, pos + 1)){
+        char before = pos == 0 ? ' ' : code[pos - 1];
+        char after = pos + name.size() >= code.size() ? ' ' : code[pos + name.size()];
+        if(!isalnum((unsigned char)before) && before != '_' && !isalnum((unsigned char)after) && after != '_')
+            return true;
+    }
+    return false;
+}
+
+// defines go right after #version, which must stay the first line
+static std::string inject_defines(const std::string &code, const std::string &define_lines){
+    if(code.compare(0, 8, "#version") != 0)
+        return define_lines + code;
+    size_t eol = code.find('\n');
+    if(eol == std::string::npos)
+        return code + '\n' + define_lines;
+    return code.substr(0, eol + 1) + define_lines + code.substr(eol + 1);
+}
+
+shader_library::shader_library(const char* vertex_shader_path, const char* fragment_shader_path)
+                    :vertex_path(vertex_shader_path), fragment_path(fragment_shader_path){
+}
+
+shader_library::expanded shader_library::expand(std::initializer_list<const char*> defines) const{
+    expanded src;
+    std::vector<std::string> included;
+    expand_includes(vertex_path, included, src.vertex_code);
+    included.clear();
+    expand_includes(fragment_path, included, src.fragment_code);
+
+    std::vector<std::string> used;
+    for(const char* def : defines){
+        std::string str(def);
+        std::string name = str.substr(0, str.find_first_of(" \t"));
+        if(mentions(src.vertex_code, name) || mentions(src.fragment_code, name))
+            used.push_back(str);
+    }
+    // the order defines are given in must not make a new program
+    std::sort(used.begin(), used.end());
+    std::string define_lines;
+    for(const std::string &def : used){
+        src.defines += def + ';';
+        define_lines += "#define " + def + '\n';
+    }
+    src.vertex_code = inject_defines(src.vertex_code, define_lines);
+    src.fragment_code = inject_defines(src.fragment_code, define_lines);
+
+    src.hash = fnv1a_64(src.vertex_code.c_str(), src.vertex_code.size() + 1);
+    src.hash = fnv1a_64(src.fragment_code.c_str(), src.fragment_code.size() + 1, src.hash);
+    return src;
+}
+
+shader_obj* shader_library::find_or_create(const expanded &src, bool &created){
+    auto range = programs.equal_range(src.hash);
+    for(auto it = range.first; it != range.second; ++it)
+        if(it->second.vertex_code == src.vertex_code && it->second.fragment_code == src.fragment_code){
+            created = false;
+            return it->second.shader.get();
+        }
+    created = true;
+    shader_obj* shader = new shader_obj();
+    programs.emplace(src.hash, program{src.vertex_code, src.fragment_code, std::unique_ptr<shader_obj>(shader)});
+    return shader;
+}
+
+static std::string variant_key(std::initializer_list<const char*> defines){
+    std::vector<std::string> list(defines.begin(), defines.end());
+    std::sort(list.begin(), list.end());
+    std::string key;
+    for(const std::string &def : list)
+        key += def + ';';
+    return key;
+}
+
+shader_obj& shader_library::get(std::initializer_list<const char*> defines){
+    std::string key = variant_key(defines);
+    auto it = variants.find(key);
+    if(it != variants.end())
+        return *it->second;
+
+    expanded src = expand(defines);
+    bool created;
+    shader_obj* shader = find_or_create(src, created);
+    if(created){
+        printf("[Shader WARNING] Permutation {%s} of %s compiled on first use\n", key.c_str(), fragment_path.c_str());
+        shader_batch batch;
+        batch.add_source(*shader, src.vertex_code, src.fragment_code, src.defines);
+        batch.build();
+    }
+    variants[key] = shader;
+    return *shader;
+}
+
+void shader_library::warm_up(std::initializer_list<std::initializer_list<const char*>> list){
+    shader_batch batch;
+    for(std::initializer_list<const char*> defines : list){
+        std::string key = variant_key(defines);
+        if(variants.count(key))
+            continue;
+        expanded src = expand(defines);
+        bool created;
+        shader_obj* shader = find_or_create(src, created);
+        if(created)
+            batch.add_source(*shader, src.vertex_code, src.fragment_code, src.defines);
+        variants[key] = shader;
+    }
+    batch.build();
+}
+
+unsigned int shader_library::program_cnt() const{
+    return programs.size();
+}
+
+const char* shader_obj::binary_cache_dir = "../shader_cache";
+shader_obj::startup_stats shader_obj::startup = {0, 0, 0.0};
+
+// header in front of every cached program binary
+struct program_binary_header{
+    unsigned int magic;
+    unsigned int format;
+    unsigned int length;
+    unsigned int reserved;
+    unsigned long long key;
+};
+static const unsigned int program_binary_magic = 0x42504c47; // "GLPB"
+
+bool shader_obj::binary_cache_available(){
+    if(binary_cache_dir == NULL || !GLAD_GL_ARB_get_program_binary)
+        return false;
+    int formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+unsigned long long shader_obj::binary_cache_key(const std::string &vertex_code, const std::string &fragment_code, const std::string &defines){
+    // a driver update invalidates every binary, so the driver is part of the key
+    const GLenum driver_str[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    unsigned long long h = fnv1a_64(NULL, 0);
+    for(GLenum name : driver_str){
+        const char* str = (const char*)glGetString(name);
+        if(str != NULL)
+            h = fnv1a_64(str, strlen(str) + 1, h);
+    }
+    h = fnv1a_64(defines.c_str(), defines.size() + 1, h);
+    h = fnv1a_64(vertex_code.c_str(), vertex_code.size() + 1, h);
+    h = fnv1a_64(fragment_code.c_str(), fragment_code.size() + 1, h);
+    // 0 means no key
+    return h == 0 ? 1 : h;
+}
+
+std::string shader_obj::binary_cache_path(unsigned long long key){
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", key);
+    return std::string(binary_cache_dir) + name;
+}
+
+bool shader_obj::load_binary(unsigned long long key){
+    FILE* fp = fopen(binary_cache_path(key).c_str(), "rb");
+    if(fp == NULL)
+        return false;
+    program_binary_header header;
+    std::vector<char> binary;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+                && header.magic == program_binary_magic && header.key == key;
+    if(ok){
+        binary.resize(header.length);
+        ok = fread(binary.data(), 1, header.length, fp) == header.length;
+    }
+    fclose(fp);
+    if(!ok)
+        return false;
+
+    program_id = glCreateProgram();
+    glProgramBinary(program_id, header.format, binary.data(), header.length);
+    int success;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &success);
+    if(!success){
+        // rejected by the driver, the source path will overwrite it
+        glDeleteProgram(program_id);
+        program_id = 0;
+        return false;
+    }
+    return true;
+}
+
+void shader_obj::save_binary(unsigned long long key){
+    int success, length = 0;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &success);
+    glGetProgramiv(program_id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(!success || length <= 0)
+        return;
+    program_binary_header header = {program_binary_magic, 0, 0, 0, key};
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program_id, length, &length, &format, binary.data());
+    header.format = format;
+    header.length = length;
+
+    MKDIR(binary_cache_dir);
+    FILE* fp = fopen(binary_cache_path(key).c_str(), "wb");
+    if(fp == NULL)
+        return;
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(binary.data(), 1, length, fp);
+    fclose(fp);
+}
+
+shader_obj::lookup_stats shader_obj::frame_lookup = {0, 0};
+shader_obj::upload_stats shader_obj::frame_upload = {0, 0};
+shader_obj* shader_obj::current = NULL;
+
+void shader_obj::new_frame(){
+    frame_lookup.cached = 0;
+    frame_lookup.driver = 0;
+    frame_upload.skipped = 0;
+    frame_upload.issued = 0;
+}
+
+// bytes of one element and whether the shadow copy holds floats,
+// 0 bytes means the type is not shadowed (doubles)
+static unsigned int uniform_type_bytes(GLenum type, bool &is_float){
+    is_float = true;
+    switch(type){
+        case GL_FLOAT:              return 4;
+        case GL_FLOAT_VEC2:         return 8;
+        case GL_FLOAT_VEC3:         return 12;
+        case GL_FLOAT_VEC4:         return 16;
+        case GL_FLOAT_MAT2:         return 16;
+        case GL_FLOAT_MAT3:         return 36;
+        case GL_FLOAT_MAT4:         return 64;
+        case GL_FLOAT_MAT2x3:       return 24;
+        case GL_FLOAT_MAT2x4:       return 32;
+        case GL_FLOAT_MAT3x2:       return 24;
+        case GL_FLOAT_MAT3x4:       return 48;
+        case GL_FLOAT_MAT4x2:       return 32;
+        case GL_FLOAT_MAT4x3:       return 48;
+        case GL_DOUBLE: case GL_DOUBLE_VEC2: case GL_DOUBLE_VEC3: case GL_DOUBLE_VEC4:
+        case GL_DOUBLE_MAT2: case GL_DOUBLE_MAT3: case GL_DOUBLE_MAT4:
+        case GL_DOUBLE_MAT2x3: case GL_DOUBLE_MAT2x4: case GL_DOUBLE_MAT3x2:
+        case GL_DOUBLE_MAT3x4: case GL_DOUBLE_MAT4x2: case GL_DOUBLE_MAT4x3:
+                                    return 0;
+    }
+    is_float = false;
+    switch(type){
+        case GL_INT_VEC2: case GL_BOOL_VEC2: case GL_UNSIGNED_INT_VEC2: return 8;
+        case GL_INT_VEC3: case GL_BOOL_VEC3: case GL_UNSIGNED_INT_VEC3: return 12;
+        case GL_INT_VEC4: case GL_BOOL_VEC4: case GL_UNSIGNED_INT_VEC4: return 16;
+    }
+    // int, bool, uint and every sampler type
+    return 4;
+}
+
+// cnt elements from loc on, the whole array in one call
+static void upload_uniform(int loc, GLenum type, int cnt, const unsigned char* data){
+    const float* f = (const float*)data;
+    const int* i = (const int*)data;
+    const unsigned int* u = (const unsigned int*)data;
+    switch(type){
+        case GL_FLOAT:              glUniform1fv(loc, cnt, f); break;
+        case GL_FLOAT_VEC2:         glUniform2fv(loc, cnt, f); break;
+        case GL_FLOAT_VEC3:         glUniform3fv(loc, cnt, f); break;
+        case GL_FLOAT_VEC4:         glUniform4fv(loc, cnt, f); break;
+        case GL_FLOAT_MAT2:         glUniformMatrix2fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT3:         glUniformMatrix3fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT4:         glUniformMatrix4fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT2x3:       glUniformMatrix2x3fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT2x4:       glUniformMatrix2x4fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT3x2:       glUniformMatrix3x2fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT3x4:       glUniformMatrix3x4fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT4x2:       glUniformMatrix4x2fv(loc, cnt, GL_FALSE, f); break;
+        case GL_FLOAT_MAT4x3:       glUniformMatrix4x3fv(loc, cnt, GL_FALSE, f); break;
+        case GL_UNSIGNED_INT:       glUniform1uiv(loc, cnt, u); break;
+        case GL_UNSIGNED_INT_VEC2:  glUniform2uiv(loc, cnt, u); break;
+        case GL_UNSIGNED_INT_VEC3:  glUniform3uiv(loc, cnt, u); break;
+        case GL_UNSIGNED_INT_VEC4:  glUniform4uiv(loc, cnt, u); break;
+        case GL_INT_VEC2: case GL_BOOL_VEC2: glUniform2iv(loc, cnt, i); break;
+        case GL_INT_VEC3: case GL_BOOL_VEC3: glUniform3iv(loc, cnt, i); break;
+        case GL_INT_VEC4: case GL_BOOL_VEC4: glUniform4iv(loc, cnt, i); break;
+        default:                    glUniform1iv(loc, cnt, i); break;
+    }
+}
+
+// current value of a uniform element, so arrays start out known
+static void read_uniform(unsigned int program, int loc, bool is_float, GLenum type, unsigned char* data){
+    if(is_float)
+        glGetUniformfv(program, loc, (float*)data);
+    else if(type == GL_UNSIGNED_INT || type == GL_UNSIGNED_INT_VEC2 ||
+            type == GL_UNSIGNED_INT_VEC3 || type == GL_UNSIGNED_INT_VEC4)
+        glGetUniformuiv(program, loc, (unsigned int*)data);
+    else
+        glGetUniformiv(program, loc, (int*)data);
+}
+
+void shader_obj::collect_uniforms(){
+    int cnt = 0, max_len = 0;
+    glGetProgramiv(program_id, GL_ACTIVE_UNIFORMS, &cnt);
+    glGetProgramiv(program_id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_len);
+
+    uniforms.clear();
+    shadow.clear();
+    dirty_list.clear();
+
+    // names of every entry, the table is sized once they are all known
+    std::vector<std::pair<std::string, int>> names;
+    std::vector<char> name(max_len + 1);
+    for(int i=0; i<cnt; i++){
+        int size;
+        uniform_info u;
+        glGetActiveUniform(program_id, i, max_len + 1, NULL, &size, &u.type, name.data());
+        u.loc = glGetUniformLocation(program_id, name.data());
+        // members of uniform blocks have no location
+        if(u.loc < 0)
+            continue;
+        u.bytes = uniform_type_bytes(u.type, u.is_float);
+        u.first = uniforms.size();
+        u.known = false;
+        u.dirty = false;
+        // arrays are reported as "name[0]", make "name" reachable too
+        char* bracket = strstr(name.data(), "[0]");
+        bool array = bracket != NULL && bracket[3] == '\0';
+        if(array)
+            *bracket = '\0';
+        // arrays of doubles are not shadowed, their other elements go to the driver
+        u.size = array && u.bytes > 0 ? size : 1;
+        for(int e=0; e<u.size; e++){
+            uniform_info element = u;
+            element.offset = shadow.size() + e * u.bytes;
+            if(e > 0){
+                std::string key = std::string(name.data()) + "[" + std::to_string(e) + "]";
+                element.loc = glGetUniformLocation(program_id, key.c_str());
+                element.size = 0;
+                names.emplace_back(key, u.first + e);
+            }
+            uniforms.push_back(element);
+        }
+        shadow.resize(shadow.size() + u.size * u.bytes);
+        names.emplace_back(name.data(), u.first);
+        if(array)
+            names.emplace_back(std::string(name.data()) + "[0]", u.first);
+        // a flush sends the whole array, so it must start as what GL has
+        if(u.size > 1){
+            for(int e=0; e<u.size; e++){
+                uniform_info &element = uniforms[u.first + e];
+                read_uniform(program_id, element.loc, u.is_float, u.type, shadow.data() + element.offset);
+                element.known = true;
+            }
+        }
+    }
+
+    // keep the load factor under 1/2, capacity is a power of two
+    unsigned int cap = 8;
+    while(cap < names.size() * 2)
+        cap <<= 1;
+    uniform_slots.assign(cap, uniform_slot{0, -1});
+    for(const std::pair<std::string, int> &n : names)
+        insert_uniform(n.first.c_str(), n.second);
+}
+
+unsigned int uniform_block_binding(const char* block_name){
+    static std::vector<std::string> names = {"Camera"};
+    // 36 is the least GL 3.3 allows
+    static int max_bindings = 0;
+    if(max_bindings == 0){
+        max_bindings = 36;
+        glGetIntegerv(GL_MAX_UNIFORM_BUFFER_BINDINGS, &max_bindings);
+    }
+    unsigned int binding = 0;
+    while(binding < names.size() && names[binding] != block_name)
+        binding++;
+    if(binding == names.size()){
+        names.push_back(block_name);
+        // reported once, later requests of the name get -1 silently
+        if(binding >= (unsigned int)max_bindings)
+            printf("[Shader ERROR] Uniform block %s needs binding %u, only %d available\n",
+                   block_name, binding, max_bindings);
+    }
+    return binding < (unsigned int)max_bindings ? binding : (unsigned int)-1;
+}
+
+void shader_obj::bind_uniform_blocks(){
+    // block bindings are not part of a program binary, so set them every time
+    int cnt = 0, max_len = 0;
+    glGetProgramiv(program_id, GL_ACTIVE_UNIFORM_BLOCKS, &cnt);
+    glGetProgramiv(program_id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_len);
+    std::vector<char> name(max_len + 1);
+    for(int i=0; i<cnt; i++){
+        glGetActiveUniformBlockName(program_id, i, max_len + 1, NULL, name.data());
+        unsigned int binding = uniform_block_binding(name.data());
+        if(binding != (unsigned int)-1)
+            glUniformBlockBinding(program_id, i, binding);
+    }
+}
+
+void shader_obj::insert_uniform(const char* name, int id){
+    unsigned int hash = uniform_hash(name);
+    unsigned int mask = uniform_slots.size() - 1;
+    for(unsigned int i = hash & mask; ; i = (i + 1) & mask){
+        uniform_slot &slot = uniform_slots[i];
+        if(slot.id == -1){
+            slot.hash = hash;
+            slot.id = id;
+            slot.name = name;
+            return;
+        }
+        if(slot.hash == hash){
+            printf("[Shader WARNING] Uniform %s hash collides, using driver lookup\n", name);
+            slot.id = -2;
+            return;
+        }
+    }
+}
+
+int shader_obj::find_uniform(unsigned int key_hash) const{
+    unsigned int mask = uniform_slots.size() - 1;
+    for(unsigned int i = key_hash & mask; ; i = (i + 1) & mask){
+        const uniform_slot &slot = uniform_slots[i];
+        if(slot.id == -1)
+            return -1;
+        if(slot.hash == key_hash)
+            return slot.id < 0 ? -1 : slot.id;
+    }
+}
+
+// an inactive or misspelled name whose hash matches an active one is not found
+int shader_obj::find_uniform(const char* key) const{
+    unsigned int key_hash = uniform_hash(key);
+    unsigned int mask = uniform_slots.size() - 1;
+    for(unsigned int i = key_hash & mask; ; i = (i + 1) & mask){
+        const uniform_slot &slot = uniform_slots[i];
+        if(slot.id == -1)
+            return -1;
+        if(slot.hash == key_hash)
+            return slot.id < 0 || slot.name != key ? -1 : slot.id;
+    }
+}
+
+int shader_obj::lookup_uniform(const char* key, int &loc) const{
+    int id = find_uniform(key);
+    if(id >= 0){
+        frame_lookup.cached++;
+        loc = uniforms[id].loc;
+        return id;
+    }
+    frame_lookup.driver++;
+    loc = glGetUniformLocation(program_id, key);
+    return -1;
+}
+
 void shader_obj::use(){
     glUseProgram(program_id);
+    current = this;
+    flush();
+}
+
+void shader_obj::flush(){
+    // glUniform* works on the program in use
+    if(current != this)
+        return;
+    for(int id : dirty_list){
+        uniform_info &u = uniforms[id];
+        upload_uniform(u.loc, u.type, u.size, shadow.data() + u.offset);
+        u.dirty = false;
+        frame_upload.issued++;
+    }
+    dirty_list.clear();
+}
+
+void shader_obj::flush_current(){
+    if(current != NULL)
+        current->flush();
+}
+
+void shader_obj::write_uniform(int id, const void* data, unsigned int bytes, bool is_float){
+    uniform_info &u = uniforms[id];
+    if(u.bytes != bytes || u.is_float != is_float){
+        printf("[Shader ERROR] Uniform type mismatch\n");
+        return;
+    }
+    unsigned char* dst = shadow.data() + u.offset;
+    if(u.known && memcmp(dst, data, bytes) == 0){
+        frame_upload.skipped++;
+        return;
+    }
+    memcpy(dst, data, bytes);
+    u.known = true;
+    // array elements are flushed together through element 0
+    uniform_info &first = uniforms[u.first];
+    if(!first.dirty){
+        first.dirty = true;
+        dirty_list.push_back(u.first);
+    }
 }
 
 int shader_obj::get_uniform_loc(const char* key) const{
-    return glGetUniformLocation(program_id, key);
+    int loc;
+    lookup_uniform(key, loc);
+    return loc;
+}
+
+int shader_obj::get_uniform_loc(unsigned int key_hash) const{
+    int id = find_uniform(key_hash);
+    if(id < 0)
+        return -1;
+    frame_lookup.cached++;
+    return uniforms[id].loc;
 }
-void shader_obj::set_bool(const char* key, bool val) const{
+
+uniform_handle shader_obj::get_uniform_handle(const char* key) const{
+    uniform_handle h;
+    h.id = find_uniform(key);
+    if(h.id < 0)
+        printf("[Shader WARNING] Uniform %s is not active\n", key);
+    return h;
+}
+
+// uniforms missing from the table are set right away, like before shadowing
+void shader_obj::set_bool(const char* key, bool val){
     set_int(key, (int)val);
 }
 
-void shader_obj::set_int(const char* key, int val) const{
-    glUniform1i(get_uniform_loc(key), val);
+void shader_obj::set_int(const char* key, int val){
+    int loc, id = lookup_uniform(key, loc);
+    if(id >= 0)
+        return write_uniform(id, &val, sizeof(val), false);
+    glUniform1i(loc, val);
+    frame_upload.issued++;
+}
+
+void shader_obj::set_float(const char* key, float val){
+    int loc, id = lookup_uniform(key, loc);
+    if(id >= 0)
+        return write_uniform(id, &val, sizeof(val), true);
+    glUniform1f(loc, val); 
+    frame_upload.issued++;
 }
 
-void shader_obj::set_float(const char* key, float val) const{
-    glUniform1f(get_uniform_loc(key), val); 
+void shader_obj::set_matrix(const char* key, const glm::mat4 &mat){
+    int loc, id = lookup_uniform(key, loc);
+    if(id >= 0)
+        return write_uniform(id, glm::value_ptr(mat), sizeof(mat), true);
+    glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(mat));
+    frame_upload.issued++;
 }
 
-void shader_obj::set_matrix(const char* key, const glm::mat4 &mat) const{
-    glUniformMatrix4fv(get_uniform_loc(key), 1, GL_FALSE, glm::value_ptr(mat));
+void shader_obj::set_vec(const char* key, const glm::vec3 &val){
+    int loc, id = lookup_uniform(key, loc);
+    if(id >= 0)
+        return write_uniform(id, &val[0], sizeof(val), true);
+    glUniform3fv(loc, 1, &val[0]); 
+    frame_upload.issued++;
 }
 
-void shader_obj::set_vec(const char* key, const glm::vec3 &val) const{
-    glUniform3fv(get_uniform_loc(key), 1, &val[0]); 
+void shader_obj::set_vec(const char* key, const float x, const float y, const float z){
+    set_vec(key, glm::vec3(x, y, z));
 }
 
-void shader_obj::set_vec(const char* key, const float x, const float y, const float z) const{
-    glUniform3f(get_uniform_loc(key), x, y, z);
+void shader_obj::set_vec(const char* key, const glm::vec4 &val){
+    int loc, id = lookup_uniform(key, loc);
+    if(id >= 0)
+        return write_uniform(id, &val[0], sizeof(val), true);
+    glUniform4fv(loc, 1, &val[0]); 
+    frame_upload.issued++;
 }
 
-void shader_obj::set_vec(const char* key, const glm::vec4 &val) const{
-    glUniform4fv(get_uniform_loc(key), 1, &val[0]); 
+void shader_obj::set_vec(const char* key, const float x, const float y, const float z, const float w){
+    set_vec(key, glm::vec4(x, y, z, w));
 }
 
-void shader_obj::set_vec(const char* key, const float x, const float y, const float z, const float w) const{
-    glUniform4f(get_uniform_loc(key), x, y, z, w);
+void shader_obj::set_bool(uniform_handle h, bool val){
+    set_int(h, (int)val);
+}
+
+void shader_obj::set_int(uniform_handle h, int val){
+    if(h.id >= 0)
+        write_uniform(h.id, &val, sizeof(val), false);
+}
+
+void shader_obj::set_float(uniform_handle h, float val){
+    if(h.id >= 0)
+        write_uniform(h.id, &val, sizeof(val), true);
+}
+
+void shader_obj::set_matrix(uniform_handle h, const glm::mat4 &mat){
+    if(h.id >= 0)
+        write_uniform(h.id, glm::value_ptr(mat), sizeof(mat), true);
+}
+
+void shader_obj::set_vec(uniform_handle h, const glm::vec3 &val){
+    if(h.id >= 0)
+        write_uniform(h.id, &val[0], sizeof(val), true);
+}
+
+void shader_obj::set_vec(uniform_handle h, const glm::vec4 &val){
+    if(h.id >= 0)
+        write_uniform(h.id, &val[0], sizeof(val), true);
 }
 
 void shader_obj::blind_texture(const char* key, unsigned int pos){
@@ -127,34 +812,374 @@ void shader_obj::check_compile_errors(unsigned int shader, const char* type)
 }    
 
 shader_obj::~shader_obj(){
+    if(current == this)
+        current = NULL;
     //glDeleteProgram(program_id);
 }
 
-texture_obj::texture_obj(const char* file_name, GLenum color_format){
+size_t texture_obj::bytes_uncompressed = 0;
+size_t texture_obj::bytes_stored = 0;
+
+texture_obj::texture_obj(const char* file_name, GLenum color_format, bool compress, bool normal_map){
+    // pre-mipmapped containers go straight from the mapped file to GL
+    if(ktx_obj::is_ktx(file_name)){
+        glGenTextures(1, &texture_id);
+        glBindTexture(GL_TEXTURE_2D, texture_id);
+        set_default_params();
+        ktx_obj ktx(file_name);
+        if(ktx.valid){
+            ktx.upload();
+            printf("[OK] Texture %s %u*%u %zu levels mapped.\n", file_name, ktx.height, ktx.width, ktx.levels.size());
+        }
+        return;
+    }
     int width, height, nrCh;
     unsigned char* data = stbi_load(file_name, &width, &height, &nrCh, 0);
     stbi_set_flip_vertically_on_load(true);
     glGenTextures(1, &texture_id);
     glBindTexture(GL_TEXTURE_2D, texture_id);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    set_default_params();
 
     if(data){
-        glTexImage2D(GL_TEXTURE_2D, 0, color_format, width, height, 0, color_format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        // colour images are averaged in linear light, normal maps as stored
+        mip_options opt;
+        opt.srgb = mip_srgb(nrCh, normal_map);
+        mip_chain mips = build_mip_chain(data, width, height, nrCh, opt);
+        if(!compress || !upload_compressed(data, width, height, nrCh, mips, normal_map))
+            upload(data, width, height, color_format, mips);
         printf("[OK] Texture %s %d*%d %dchs readed.\n", file_name, height, width, nrCh);
     }else
         printf("[File ERROR] Fail to load texture.\n");
     stbi_image_free(data);
 }
 
+void texture_obj::set_default_params(){
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+void texture_obj::upload(const unsigned char* data, int width, int height, GLenum color_format){
+    glTexImage2D(GL_TEXTURE_2D, 0, color_format, width, height, 0, color_format, GL_UNSIGNED_BYTE, data);
+    glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+void texture_obj::upload(const unsigned char* data, int width, int height, GLenum color_format, const mip_chain &mips){
+    // small levels have rows of any length
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, color_format, width, height, 0, color_format, GL_UNSIGNED_BYTE, data);
+    for(unsigned int i=0; i<mips.levels.size(); i++){
+        const mip_level &level = mips.levels[i];
+        glTexImage2D(GL_TEXTURE_2D, i + 1, color_format, level.width, level.height, 0, color_format, GL_UNSIGNED_BYTE, level.pixels.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mips.levels.size());
+
+    // 8 bit channels as given, the driver may pad rgb
+    int channels = color_format == GL_RGBA ? 4 : color_format == GL_RGB ? 3 : color_format == GL_RG ? 2 : 1;
+    size_t bytes = (size_t)width * height * channels;
+    for(const mip_level &level : mips.levels)
+        bytes += (size_t)level.width * level.height * channels;
+    bytes_uncompressed += bytes;
+    bytes_stored += bytes;
+}
+
+bool texture_obj::upload_compressed(const unsigned char* data, int width, int height, int channels,
+                                    const mip_chain &mips, bool normal_map){
+    bc_format format = bc_pick_format(channels, normal_map);
+    if(!bc_supported(format))
+        return false;
+    GLenum internal_format = bc_internal_format(format);
+    for(unsigned int i=0; i<=mips.levels.size(); i++){
+        const unsigned char* pixels = i == 0 ? data : mips.levels[i - 1].pixels.data();
+        int w = i == 0 ? width : mips.levels[i - 1].width;
+        int h = i == 0 ? height : mips.levels[i - 1].height;
+        std::vector<unsigned char> blocks = bc_encode(pixels, w, h, channels, format, BC_FAST, 0);
+        glCompressedTexImage2D(GL_TEXTURE_2D, i, internal_format, w, h, 0, blocks.size(), blocks.data());
+        bytes_uncompressed += (size_t)w * h * channels;
+        bytes_stored += blocks.size();
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mips.levels.size());
+    return true;
+}
+
 void texture_obj::blind(unsigned int pos){
     glActiveTexture(GL_TEXTURE0+pos);
     glBindTexture(GL_TEXTURE_2D, texture_id);
 }
 
+uniform_ring_obj::uniform_ring_obj(unsigned int frame_size_, unsigned int frame_cnt_)
+                    :frame_size(frame_size_), frame_cnt(frame_cnt_), frame_idx(0), used(0){
+    int offset_align = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_align);
+    align = offset_align;
+    // every region starts aligned too
+    frame_size = (frame_size + align - 1) / align * align;
+    staging.resize(frame_size);
+    fences.assign(frame_cnt, (GLsync)NULL);
+
+    glGenBuffers(1, &ubo_id);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+    glBufferData(GL_UNIFORM_BUFFER, frame_size * frame_cnt, NULL, GL_DYNAMIC_DRAW);
+}
+
+uniform_ring_obj::~uniform_ring_obj(){
+    /*
+    for(GLsync fence : fences)
+        if(fence != NULL)
+            glDeleteSync(fence);
+    glDeleteBuffers(1, &ubo_id);
+    */
+}
+
+void uniform_ring_obj::begin_frame(){
+    frame_idx = (frame_idx + 1) % frame_cnt;
+    used = 0;
+    GLsync &fence = fences[frame_idx];
+    if(fence == NULL)
+        return;
+    // only blocks when the CPU is frame_cnt frames ahead of the GPU
+    while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(fence);
+    fence = NULL;
+}
+
+unsigned int uniform_ring_obj::alloc(const void* data, unsigned int size){
+    unsigned int offset = (used + align - 1) / align * align;
+    if(offset + size > frame_size){
+        printf("[Buffer ERROR] Uniform ring frame of %u bytes is full\n", frame_size);
+        return (unsigned int)-1;
+    }
+    memcpy(staging.data() + offset, data, size);
+    used = offset + size;
+    return frame_idx * frame_size + offset;
+}
+
+void uniform_ring_obj::upload(){
+    if(used == 0)
+        return;
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+    // the fence already guarantees the region is idle
+    void* dst = glMapBufferRange(GL_UNIFORM_BUFFER, frame_idx * frame_size, used,
+                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if(dst == NULL){
+        glBufferSubData(GL_UNIFORM_BUFFER, frame_idx * frame_size, used, staging.data());
+        return;
+    }
+    memcpy(dst, staging.data(), used);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+}
+
+bool uniform_ring_obj::bind_range(unsigned int binding, unsigned int offset, unsigned int size){
+    // uniform_block_binding() already reported a missing binding
+    if(binding == (unsigned int)-1)
+        return false;
+    if(offset == (unsigned int)-1){
+        printf("[Buffer ERROR] Uniform ring block was not allocated, binding %u left as is\n", binding);
+        return false;
+    }
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, ubo_id, offset, size);
+    return true;
+}
+
+void uniform_ring_obj::end_frame(){
+    fences[frame_idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+dynamic_vertex_stream::dynamic_vertex_stream(const std::vector<vertex_attrib> &attribs, unsigned int stride_,
+                                unsigned int frame_size_, unsigned int frame_cnt_, method mode_)
+                    :stride(stride_), frame_size(frame_size_), frame_cnt(frame_cnt_), mode(mode_),
+                    mapped(NULL), region(NULL), frame_idx(0), used(0){
+    if(mode == PERSISTENT && !GLAD_GL_ARB_buffer_storage)
+        mode = UNSYNCHRONIZED;
+    // regions start on a whole vertex, so draws count from the buffer start
+    frame_size = frame_size / stride * stride;
+    fences.assign(frame_cnt, (GLsync)NULL);
+
+    glGenVertexArrays(1, &VAO_id);
+    glBindVertexArray(VAO_id);
+    if(!create_buffer()){
+        printf("[Buffer ERROR] Fail to map a persistent vertex stream, mapping per frame\n");
+        glDeleteBuffers(1, &VBO_id);
+        mode = UNSYNCHRONIZED;
+        create_buffer();
+    }
+    for(unsigned int i=0; i<attribs.size(); i++){
+        const vertex_attrib &attrib = attribs[i];
+        glVertexAttribPointer(i, attrib.stored, attrib.gl_type(), attrib.normalized(), stride, (void*)(size_t)attrib.offset);
+        glEnableVertexAttribArray(i);
+    }
+    glBindVertexArray(0);
+}
+
+bool dynamic_vertex_stream::create_buffer(){
+    glGenBuffers(1, &VBO_id);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+    GLsizeiptr size = (GLsizeiptr)frame_size * frame_cnt;
+    if(mode != PERSISTENT){
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        return true;
+    }
+    // coherent, so writes need no flush before the draw
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+    mapped = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    return mapped != NULL;
+}
+
+dynamic_vertex_stream::~dynamic_vertex_stream(){
+    /*
+    for(GLsync fence : fences)
+        if(fence != NULL)
+            glDeleteSync(fence);
+    glDeleteBuffers(1, &VBO_id);
+    glDeleteVertexArrays(1, &VAO_id);
+    */
+}
+
+void dynamic_vertex_stream::begin_frame(){
+    if(region != NULL && mode != PERSISTENT)
+        upload();
+    frame_idx = (frame_idx + 1) % frame_cnt;
+    used = 0;
+    GLsync &fence = fences[frame_idx];
+    if(fence != NULL){
+        // only blocks when the CPU is frame_cnt frames ahead of the GPU
+        while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        fence = NULL;
+    }
+    if(mode == PERSISTENT){
+        region = mapped + (size_t)frame_idx * frame_size;
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+    // new storage from the driver, draws still in flight keep the old one
+    if(mode == ORPHAN && frame_idx == 0)
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)frame_size * frame_cnt, NULL, GL_STREAM_DRAW);
+    // the fence or the orphaning already guarantees the region is idle
+    region = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, (GLintptr)frame_idx * frame_size, frame_size,
+                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+    if(region == NULL)
+        printf("[Buffer ERROR] Fail to map a vertex stream region\n");
+}
+
+void* dynamic_vertex_stream::alloc(unsigned int vertex_num, unsigned int &first){
+    unsigned int bytes = vertex_num * stride;
+    if(region == NULL)
+        return NULL;
+    if(used + bytes > frame_size){
+        printf("[Buffer ERROR] Vertex stream frame of %u bytes is full\n", frame_size);
+        return NULL;
+    }
+    first = (frame_idx * frame_size + used) / stride;
+    void* dst = region + used;
+    used += bytes;
+    return dst;
+}
+
+void dynamic_vertex_stream::upload(){
+    if(mode == PERSISTENT || region == NULL)
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+    // only what was written goes to the GPU
+    if(used != 0)
+        glFlushMappedBufferRange(GL_ARRAY_BUFFER, 0, used);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    region = NULL;
+}
+
+void dynamic_vertex_stream::draw_array(GLenum draw_mode, unsigned int first, unsigned int num){
+    if(first == (unsigned int)-1)
+        return;
+    shader_obj::flush_current();
+    glBindVertexArray(VAO_id);
+    glDrawArrays(draw_mode, first, num);
+}
+
+void dynamic_vertex_stream::end_frame(){
+    upload();
+    if(mode != ORPHAN)
+        fences[frame_idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+object_table_obj::object_table_obj(unsigned int capacity_):capacity(capacity_){
+    glGenBuffers(1, &buffer_id);
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * texels_per_object * capacity, NULL, GL_STREAM_DRAW);
+    glGenTextures(1, &texture_id);
+    glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+    // follows the buffer when upload() reallocates its storage
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_id);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    texels.reserve(texels_per_object * capacity);
+}
+
+object_table_obj::~object_table_obj(){
+    /*
+    glDeleteTextures(1, &texture_id);
+    glDeleteBuffers(1, &buffer_id);
+    */
+}
+
+void object_table_obj::clear(){
+    texels.clear();
+}
+
+unsigned int object_table_obj::add(const glm::mat4 &model, unsigned int material_id,
+                            const glm::vec3 &pos_scale, const glm::vec3 &pos_offset){
+    unsigned int row = size();
+    glm::mat4 decode = glm::scale(glm::translate(glm::mat4(1.0f), pos_offset), pos_scale);
+    glm::mat4 world = model * decode;
+    glm::mat3 normal = glm::transpose(glm::inverse(glm::mat3(model)));
+    for(int i=0; i<4; i++)
+        texels.push_back(world[i]);
+    for(int i=0; i<3; i++)
+        texels.push_back(glm::vec4(normal[i], 0.0f));
+    // exact as a float below 2^24
+    texels[row * texels_per_object + 4].w = (float)material_id;
+    return row;
+}
+
+unsigned int object_table_obj::size() const{
+    return texels.size() / texels_per_object;
+}
+
+void object_table_obj::upload(){
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+    if(size() > capacity){
+        int max_texels = 65536;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+        if(texels.size() > (size_t)max_texels)
+            printf("[Buffer ERROR] %u objects exceed the texture buffer limit of %d texels\n", size(), max_texels);
+        capacity = size() * 2;
+    }
+    // one orphaning call, draws of the last frame keep their copy
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * texels_per_object * capacity, NULL, GL_STREAM_DRAW);
+    if(!texels.empty())
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(glm::vec4) * texels.size(), texels.data());
+}
+
+void object_table_obj::blind(unsigned int pos){
+    glActiveTexture(GL_TEXTURE0+pos);
+    glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+}
+
+bool vertex_array_obj::depth_pass = false;
+
+// one attribute of every interleaved vertex, tightly packed
+static std::vector<unsigned char> gather_attribute(const void* vertices, unsigned int vertex_num, unsigned int stride,
+                                                   unsigned int offset, unsigned int bytes){
+    std::vector<unsigned char> result((size_t)bytes * vertex_num);
+    const unsigned char* src = (const unsigned char*)vertices + offset;
+    for(unsigned int i=0; i<vertex_num; i++)
+        memcpy(&result[(size_t)i * bytes], src + (size_t)i * stride, bytes);
+    return result;
+}
+
 vertex_array_obj::vertex_array_obj(unsigned int vertex_num, std::initializer_list<unsigned int> vertex_div, float* vertex_data,
                             unsigned int element_num, unsigned int* element_data, 
                             GLenum buffer_usage){
@@ -185,16 +1210,130 @@ vertex_array_obj::vertex_array_obj(unsigned int vertex_num, std::initializer_lis
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*element_num, element_data, buffer_usage);
     }
 
-    int i=0, j=0;
-    for(const unsigned int &item : vertex_div){
-        glVertexAttribPointer(i, item, GL_FLOAT, GL_FALSE, vertex_per_size*sizeof(float), (void*)(j*sizeof(float)));
+    set_float_attributes(vertex_div.begin(), vertex_div.size());
+    
+    glBindVertexArray(0);
+
+}
+
+vertex_array_obj::vertex_array_obj(const indexed_mesh &mesh, GLenum buffer_usage, bool depth_stream){
+    v_cnt = mesh.vertex_cnt();
+    e_cnt = mesh.indices.size();
+    e_type = mesh.index_type();
+    glGenVertexArrays(1, &VAO_id);
+    glBindVertexArray(VAO_id);
+    glGenBuffers(1, &VBO_id);
+    glGenBuffers(1, &EBO_id);
+
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_id);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float)*mesh.vertices.size(), mesh.vertices.data(), buffer_usage);
+    upload_indices(mesh.indices, buffer_usage);
+
+    set_float_attributes(mesh.vertex_div.data(), mesh.vertex_div.size());
+
+    glBindVertexArray(0);
+    if(depth_stream && !mesh.vertex_div.empty()){
+        unsigned int comps = mesh.vertex_div[0];
+        vertex_attrib position = {ATTRIB_FLOAT, comps, comps, 0};
+        create_depth_array(position, gather_attribute(mesh.vertices.data(), v_cnt, mesh.vertex_size * sizeof(float),
+                                                      0, position.bytes()).data(), buffer_usage);
+    }
+}
+
+vertex_array_obj::vertex_array_obj(const packed_mesh &mesh, GLenum buffer_usage, bool depth_stream)
+                    :vertex_array_obj(mesh.attribs, mesh.stride, {mesh.vertices.data()}, mesh.vertex_cnt(), mesh.indices,
+                                      buffer_usage, depth_stream){
+}
+
+vertex_array_obj::vertex_array_obj(const std::vector<vertex_attrib> &attribs, unsigned int stride,
+                            std::initializer_list<const void*> streams, unsigned int vertex_num,
+                            const std::vector<unsigned int> &indices, GLenum buffer_usage,
+                            bool depth_stream){
+    // nothing to draw, and split streams would have no first buffer
+    if(attribs.empty()){
+        printf("[Buffer ERROR] Vertex array without attributes\n");
+        VAO_id = VBO_id = EBO_id = 0;
+        v_cnt = e_cnt = 0;
+        return;
+    }
+    v_cnt = vertex_num;
+    e_cnt = indices.size();
+    e_type = vertex_num < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    bool split = stride == 0;
+    if(streams.size() != (split ? attribs.size() : 1))
+        printf("[Buffer ERROR] %zu vertex streams for %zu attributes\n", streams.size(), attribs.size());
+    glGenVertexArrays(1, &VAO_id);
+    glBindVertexArray(VAO_id);
+    stream_ids.resize(split ? attribs.size() : 1);
+    glGenBuffers(stream_ids.size(), stream_ids.data());
+    VBO_id = stream_ids[0];
+    if(!split)
+        stream_ids.clear();
+
+    const void* const* data = streams.begin();
+    for(unsigned int i=0; i<attribs.size(); i++){
+        const vertex_attrib &attrib = attribs[i];
+        if(split || i == 0){
+            unsigned int stream = split ? i : 0;
+            glBindBuffer(GL_ARRAY_BUFFER, split ? stream_ids[i] : VBO_id);
+            glBufferData(GL_ARRAY_BUFFER, (size_t)(split ? attrib.bytes() : stride) * vertex_num,
+                         stream < streams.size() ? data[stream] : NULL, buffer_usage);
+        }
+        glVertexAttribPointer(i, attrib.stored, attrib.gl_type(), attrib.normalized(), split ? attrib.bytes() : stride,
+                              (void*)(size_t)(split ? 0 : attrib.offset));
         glEnableVertexAttribArray(i);
-        i+=1;
-        j+=item;
     }
-    
+    if(e_cnt != 0){
+        glGenBuffers(1, &EBO_id);
+        upload_indices(indices, buffer_usage);
+    }
+
     glBindVertexArray(0);
+    if(split)
+        create_depth_array(attribs[0], NULL, buffer_usage);
+    else if(depth_stream && streams.size() != 0 && data[0] != NULL)
+        create_depth_array(attribs[0], gather_attribute(data[0], vertex_num, stride, attribs[0].offset,
+                                                        attribs[0].bytes()).data(), buffer_usage);
+}
 
+void vertex_array_obj::create_depth_array(const vertex_attrib &position, const void* positions, GLenum buffer_usage){
+    if(positions != NULL){
+        glGenBuffers(1, &pos_VBO_id);
+        glBindBuffer(GL_ARRAY_BUFFER, pos_VBO_id);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)position.bytes() * v_cnt, positions, buffer_usage);
+    }else{
+        pos_VBO_id = stream_ids[0];
+        glBindBuffer(GL_ARRAY_BUFFER, pos_VBO_id);
+    }
+    glGenVertexArrays(1, &depth_VAO_id);
+    glBindVertexArray(depth_VAO_id);
+    glVertexAttribPointer(0, position.stored, position.gl_type(), position.normalized(), position.bytes(), (void*)0);
+    glEnableVertexAttribArray(0);
+    // same indices, so both VAOs draw the same triangles
+    if(e_cnt != 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_id);
+    glBindVertexArray(0);
+}
+
+void vertex_array_obj::upload_indices(const std::vector<unsigned int> &indices, GLenum buffer_usage){
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_id);
+    if(e_type == GL_UNSIGNED_SHORT){
+        std::vector<unsigned short> shorts(indices.begin(), indices.end());
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short)*shorts.size(), shorts.data(), buffer_usage);
+    }else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*indices.size(), indices.data(), buffer_usage);
+}
+
+void vertex_array_obj::set_float_attributes(const unsigned int* vertex_div, unsigned int div_cnt){
+    unsigned int vertex_per_size = 0;
+    for(unsigned int i=0; i<div_cnt; i++)
+        vertex_per_size += vertex_div[i];
+    int j=0;
+    for(unsigned int i=0; i<div_cnt; i++){
+        glVertexAttribPointer(i, vertex_div[i], GL_FLOAT, GL_FALSE, vertex_per_size*sizeof(float), (void*)(j*sizeof(float)));
+        glEnableVertexAttribArray(i);
+        j+=vertex_div[i];
+    }
 }
 
 vertex_array_obj::~vertex_array_obj(){
@@ -203,11 +1342,16 @@ vertex_array_obj::~vertex_array_obj(){
     glDeleteBuffers(1, &VBO_id);
     if(e_cnt != 0)
         glDeleteBuffers(1, &EBO_id);
+    if(depth_VAO_id != 0)
+        glDeleteVertexArrays(1, &depth_VAO_id);
+    for(const instance_stream &stream : instance_streams)
+        glDeleteBuffers(1, &stream.buffer_id);
     */
 }
 
 void vertex_array_obj::draw_array(GLenum draw_mode, int beg, int num){
-    glBindVertexArray(VAO_id);
+    shader_obj::flush_current();
+    glBindVertexArray(pass_array());
     glDrawArrays(draw_mode, beg, num);
 }
 
@@ -216,8 +1360,80 @@ void vertex_array_obj::draw_element(GLenum draw_mode, int num){
         printf("[Draw ERROR]\n No available element buffer to draw\n");
         return;
     }
-    glBindVertexArray(VAO_id);
-    glDrawElements(draw_mode, num, GL_UNSIGNED_INT, 0);
+    shader_obj::flush_current();
+    glBindVertexArray(pass_array());
+    glDrawElements(draw_mode, num, e_type, 0);
+}
+
+unsigned int vertex_array_obj::add_instance_stream(const std::vector<vertex_attrib> &attribs, unsigned int stride,
+                                            const void* instance_data, unsigned int instance_num,
+                                            unsigned int first_location, GLenum buffer_usage){
+    instance_stream stream = {0, stride, buffer_usage};
+    glGenBuffers(1, &stream.buffer_id);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.buffer_id);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)stride * instance_num, instance_data, buffer_usage);
+
+    unsigned int arrays[2] = {VAO_id, depth_VAO_id};
+    for(unsigned int array : arrays){
+        if(array == 0)
+            continue;
+        glBindVertexArray(array);
+        unsigned int location = first_location;
+        for(const vertex_attrib &attrib : attribs){
+            // 4 components a location, the columns of a matrix follow each other
+            for(unsigned int k=0; k<attrib.stored; k+=4, location++){
+                unsigned int offset = attrib.offset + attrib.bytes() / attrib.stored * k;
+                glVertexAttribPointer(location, std::min(attrib.stored - k, 4u), attrib.gl_type(), attrib.normalized(),
+                                      stride, (void*)(size_t)offset);
+                glEnableVertexAttribArray(location);
+                glVertexAttribDivisor(location, 1);
+            }
+        }
+    }
+    glBindVertexArray(0);
+    instance_streams.push_back(stream);
+    return instance_streams.size() - 1;
+}
+
+void vertex_array_obj::update_instances(unsigned int stream, const void* instance_data, unsigned int instance_num){
+    if(stream >= instance_streams.size()){
+        printf("[Buffer ERROR] No instance stream %u\n", stream);
+        return;
+    }
+    const instance_stream &s = instance_streams[stream];
+    glBindBuffer(GL_ARRAY_BUFFER, s.buffer_id);
+    // the VAOs keep pointing at the buffer, only its storage changes
+    glBufferData(GL_ARRAY_BUFFER, (size_t)s.stride * instance_num, instance_data, s.usage);
+}
+
+void vertex_array_obj::draw_array_instanced(GLenum draw_mode, int beg, int num, int instance_num){
+    shader_obj::flush_current();
+    glBindVertexArray(pass_array());
+    glDrawArraysInstanced(draw_mode, beg, num, instance_num);
+}
+
+void vertex_array_obj::draw_element_instanced(GLenum draw_mode, int num, int instance_num){
+    if(e_cnt == 0){
+        printf("[Draw ERROR]\n No available element buffer to draw\n");
+        return;
+    }
+    shader_obj::flush_current();
+    glBindVertexArray(pass_array());
+    glDrawElementsInstanced(draw_mode, num, e_type, 0, instance_num);
+}
+
+unsigned int vertex_array_obj::pass_array() const{
+    return depth_pass && depth_VAO_id != 0 ? depth_VAO_id : VAO_id;
+}
+
+void vertex_array_obj::begin_depth_pass(){
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    depth_pass = true;
+}
+
+void vertex_array_obj::end_depth_pass(){
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    depth_pass = false;
 }
 
 camera_obj::camera_obj(float screen_w_div_h_, glm::vec3 position_,
@@ -240,12 +1456,31 @@ void camera_obj::calc_projection(){
     projection = glm::perspective(glm::radians(fov), screen_w_div_h, 0.1f, 100.0f);
 }
 
-void camera_obj::update_shader_uniform(const shader_obj& shader, const char* view_key, const char* proj_key, const char* model_key){
+void camera_obj::update_shader_uniform(shader_obj& shader, const char* view_key, const char* proj_key, const char* model_key){
     shader.set_matrix(view_key, view);
     shader.set_matrix(proj_key, projection);
     shader.set_matrix(model_key, model);
 }
 
+void camera_obj::update_shader_uniform(shader_obj& shader, uniform_handle view_h, uniform_handle proj_h, uniform_handle model_h){
+    shader.set_matrix(view_h, view);
+    shader.set_matrix(proj_h, projection);
+    shader.set_matrix(model_h, model);
+}
+
+void camera_obj::update_shader_uniform(shader_obj& shader, uniform_handle model_h){
+    shader.set_matrix(model_h, model);
+}
+
+void camera_obj::update_uniform_buffer(float time){
+    ubo.data.view = view;
+    ubo.data.projection = projection;
+    ubo.data.view_projection = projection * view;
+    ubo.data.camera_pos = position;
+    ubo.data.time = time;
+    ubo.upload();
+}
+
 void camera_obj::change_pos(enum dir move_dir, float step){
     if (move_dir == UP)
         position += step * front;
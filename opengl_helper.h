@@ -4,47 +4,296 @@
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <cstring>
 #include <math.h>
 #include <glm/glm.hpp>
 #include <initializer_list>
+// std140 structs of the shader uniform blocks, see ubo_codegen.cpp
+#include "uniform_blocks.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
 
 
 #define KEY_VAL(X) #X,X 
 
 class texture_obj;
+struct mip_chain;
+struct indexed_mesh;
+struct packed_mesh;
+struct vertex_attrib;
+
+// FNV-1a hash of a uniform name, usable at compile time
+constexpr unsigned int uniform_hash(const char* str, unsigned int h = 2166136261u){
+    return *str ? uniform_hash(str + 1, (h ^ (unsigned char)*str) * 16777619u) : h;
+}
+
+// binding point of a named uniform block, handed out on first request and
+// the same for every program, "Camera" is always 0. -1 (as unsigned) once
+// GL_MAX_UNIFORM_BUFFER_BINDINGS names are taken, the block stays unbound
+unsigned int uniform_block_binding(const char* block_name);
+
+// index of an active uniform inside a shader_obj, -1 means not found
+struct uniform_handle{
+    int id = -1;
+};
 
 class shader_obj{
     public:
         unsigned int program_id, vertex_id, fragment_id;
 
+        // empty program, filled in later by shader_batch::build()
+        shader_obj();
         shader_obj(const char* vertex_shader_path, const char* fragment_shader_path);
         void use();
         void blind_texture(const char* key, unsigned int pos);
 
         int get_uniform_loc(const char* key) const;
-        void set_bool(const char* key, bool val) const;
-        void set_int(const char* key, int val) const;
-        void set_float(const char* key, float val) const;
-        void set_matrix(const char* key, const glm::mat4 &mat) const;
-        void set_vec(const char* key, const glm::vec3 &val) const;
-        void set_vec(const char* key, const float x, const float y, const float z) const;
-        void set_vec(const char* key, const glm::vec4 &val) const;
-        void set_vec(const char* key, const float x, const float y, const float z, const float w) const;
+        // matches on the hash alone, for names known to be active
+        int get_uniform_loc(unsigned int key_hash) const;
+        // resolve once outside the render loop, then use the handle setters
+        uniform_handle get_uniform_handle(const char* key) const;
+        void set_bool(const char* key, bool val);
+        void set_int(const char* key, int val);
+        void set_float(const char* key, float val);
+        void set_matrix(const char* key, const glm::mat4 &mat);
+        void set_vec(const char* key, const glm::vec3 &val);
+        void set_vec(const char* key, const float x, const float y, const float z);
+        void set_vec(const char* key, const glm::vec4 &val);
+        void set_vec(const char* key, const float x, const float y, const float z, const float w);
+
+        void set_bool(uniform_handle h, bool val);
+        void set_int(uniform_handle h, int val);
+        void set_float(uniform_handle h, float val);
+        void set_matrix(uniform_handle h, const glm::mat4 &mat);
+        void set_vec(uniform_handle h, const glm::vec3 &val);
+        void set_vec(uniform_handle h, const glm::vec4 &val);
+
+        // uniform location lookups of the current frame
+        struct lookup_stats{
+            unsigned int cached;    // served by the table, no driver call
+            unsigned int driver;    // fell back to glGetUniformLocation
+        };
+        static lookup_stats frame_lookup;
+
+        // setters only update a CPU copy, changed values are uploaded by
+        // flush(), which use() and the vertex_array_obj draws call
+        void flush();
+        static void flush_current();
+        // uniform uploads of the current frame
+        struct upload_stats{
+            unsigned int skipped;   // value was already set
+            unsigned int issued;    // glUniform* calls
+        };
+        static upload_stats frame_upload;
+        static void new_frame();
+
+        // directory of linked program binaries, NULL disables the cache
+        static const char* binary_cache_dir;
+        // programs created so far and how long it took
+        struct startup_stats{
+            unsigned int cache_hit;
+            unsigned int compiled;
+            double seconds;
+        };
+        static startup_stats startup;
         
         ~shader_obj();
     private:
+        friend class shader_batch;
+
+        // source compile path, issues the GL work without querying any status
+        void begin_compile(const char* vertex_code, const char* fragment_code);
+        void begin_link();
+        // report errors and release the shader objects once linking is done
+        void end_compile();
+        // try to restore program_id from a cached binary
+        bool load_binary(unsigned long long key);
+        void save_binary(unsigned long long key);
+        static bool binary_cache_available();
+        static unsigned long long binary_cache_key(const std::string &vertex_code, const std::string &fragment_code, const std::string &defines);
+        static std::string binary_cache_path(unsigned long long key);
+
+        // arrays take one entry per element, "name[n]" finds element n
+        struct uniform_info{
+            int loc;
+            GLenum type;
+            // one element of the uniform inside shadow
+            unsigned int offset, bytes;
+            bool is_float;
+            // known: shadow holds what GL has or will have after flush()
+            bool known, dirty;
+            // entry of element 0, which flush() uploads the whole array
+            // from, and on element 0 the element count
+            int first, size;
+        };
+        struct uniform_slot{
+            unsigned int hash;
+            // uniforms index, -1 empty, -2 names with colliding hashes
+            int id;
+            // compared on a hash hit, so other names never match
+            std::string name;
+        };
+        // active uniforms of the program, uniform_handle::id indexes this
+        std::vector<uniform_info> uniforms;
+        // open addressing table on the name hash
+        std::vector<uniform_slot> uniform_slots;
+        // CPU copy of every uniform value and the ones waiting for flush()
+        std::vector<unsigned char> shadow;
+        std::vector<int> dirty_list;
+        // program that use() made current
+        static shader_obj* current;
+
+        // query every active uniform after linking
+        void collect_uniforms();
+        // attach every uniform block to uniform_block_binding() of its name
+        void bind_uniform_blocks();
+        void insert_uniform(const char* name, int id);
+        int find_uniform(unsigned int key_hash) const;
+        int find_uniform(const char* key) const;
+        // table index of key or -1, loc is filled either way
+        int lookup_uniform(const char* key, int &loc) const;
+        void write_uniform(int id, const void* data, unsigned int bytes, bool is_float);
+
         // utility function for checking shader compilation/linking errors.
         void check_compile_errors(unsigned int shader, const char* type);
 };
 
+// Compiles many programs at once: every glCompileShader and glLinkProgram is
+// issued before the first status query, so the driver can overlap them.
+class shader_batch{
+    public:
+        // the program is written to shader when build()/finish() returns,
+        // #include "file" lines are expanded like shader_library does
+        void add(shader_obj& shader, const char* vertex_shader_path, const char* fragment_shader_path);
+        // already preprocessed sources, defines only take part in the cache key
+        void add_source(shader_obj& shader, const std::string &vertex_code, const std::string &fragment_code, const std::string &defines);
+        // submit() then finish()
+        void build();
+
+        // issue all the compile and link work without waiting
+        void submit();
+        // true when finish() won't block, always true without KHR_parallel_shader_compile
+        bool is_ready() const;
+        // check status, fill the binary cache and uniform tables
+        void finish();
+    private:
+        struct entry{
+            shader_obj* shader;
+            std::string vertex_code, fragment_code, defines;
+            unsigned long long key;
+            bool from_cache;
+        };
+        std::vector<entry> entries;
+        double beg_time = 0;
+};
+
+// Permutations of one vertex/fragment pair. Sources may #include "file"
+// (relative to the including file, each file at most once) and every
+// permutation is a set of defines like {"USE_SPECULAR", "LIGHT_CNT 4"}.
+// Defines the sources never mention are dropped, so permutations that
+// expand to the same text share one program.
+class shader_library{
+    public:
+        shader_library(const char* vertex_shader_path, const char* fragment_shader_path);
+
+        // program of a permutation, compiled on first use
+        shader_obj& get(std::initializer_list<const char*> defines);
+        // compile these permutations now in one batch so get() never hitches
+        void warm_up(std::initializer_list<std::initializer_list<const char*>> variants);
+
+        // distinct programs compiled so far
+        unsigned int program_cnt() const;
+    private:
+        std::string vertex_path, fragment_path;
+        // define set -> program
+        std::unordered_map<std::string, shader_obj*> variants;
+        // content hash of expanded sources -> programs, the sources are
+        // compared on a hit so a collision never hands out another program
+        struct program{
+            std::string vertex_code, fragment_code;
+            std::unique_ptr<shader_obj> shader;
+        };
+        std::unordered_multimap<unsigned long long, program> programs;
+
+        struct expanded{
+            std::string defines, vertex_code, fragment_code;
+            unsigned long long hash;
+        };
+        expanded expand(std::initializer_list<const char*> defines) const;
+        // returns the program if it already exists, otherwise creates an empty one
+        shader_obj* find_or_create(const expanded &src, bool &created);
+};
+
 class texture_obj{
     public:
         unsigned int texture_id;
 
-        texture_obj(const char* file_name, GLenum color_format);
+        // .ktx files are mapped and uploaded with their own mip levels,
+        // anything else is decoded by stbi. compress encodes it to BCn by
+        // channel count, normal maps become BC5 and the shader rebuilds z.
+        texture_obj(const char* file_name, GLenum color_format, bool compress = false, bool normal_map = false);
         // remember to use the shader at first
         void blind(unsigned int pos);
-        
+
+        // sampling state shared by every texture, the texture must be bound
+        static void set_default_params();
+        // fill the bound texture with an 8 bit image and build its mipmaps
+        static void upload(const unsigned char* data, int width, int height, GLenum color_format);
+        // same with the levels built on the CPU by build_mip_chain()
+        static void upload(const unsigned char* data, int width, int height, GLenum color_format, const mip_chain &mips);
+        // same encoded to BCn on the CPU, false when the driver lacks the format
+        static bool upload_compressed(const unsigned char* data, int width, int height, int channels,
+                                      const mip_chain &mips, bool normal_map);
+
+        // texture memory of every image loaded so far, as 8 bit pixels and
+        // as actually stored
+        static size_t bytes_uncompressed, bytes_stored;
+};
+
+// Frame ringed uniform buffer for per draw blocks. Each frame gets its own
+// region: push() stages aligned blocks on the CPU, upload() writes the whole
+// frame with one map, then bind() points a block binding at one draw's slice.
+// A fence per region keeps the CPU from overwriting frames still in flight.
+//     ring.begin_frame();
+//     unsigned int a = ring.push(block_a), b = ring.push(block_b);
+//     ring.upload();
+//     ring.bind<object_block>(a); draw...; ring.bind<object_block>(b); draw...
+//     ring.end_frame();
+class uniform_ring_obj{
+    public:
+        unsigned int ubo_id;
+        // bytes of one frame region and how many regions are in the ring
+        unsigned int frame_size, frame_cnt;
+        // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+        unsigned int align;
+
+        uniform_ring_obj(unsigned int frame_size_, unsigned int frame_cnt_ = 3);
+        ~uniform_ring_obj();
+
+        // waits until the next region is no longer read by the GPU
+        void begin_frame();
+        // returns the buffer offset of the copy, or -1 (as unsigned) when the region is full
+        unsigned int alloc(const void* data, unsigned int size);
+        template<typename T>
+        unsigned int push(const T& data){
+            return alloc(&data, sizeof(T));
+        }
+        void upload();
+        // false when offset is a failed alloc(), skip the draw then: the
+        // binding still holds another object's block
+        bool bind_range(unsigned int binding, unsigned int offset, unsigned int size);
+        template<typename T>
+        bool bind(unsigned int offset){
+            return bind_range(uniform_block_binding(T::block_name), offset, sizeof(T));
+        }
+        // fences the region used by this frame
+        void end_frame();
+    private:
+        std::vector<unsigned char> staging;
+        std::vector<GLsync> fences;
+        unsigned int frame_idx, used;
 };
 
 class vertex_array_obj{
@@ -59,13 +308,193 @@ class vertex_array_obj{
         unsigned int v_cnt;
         // Element number
         unsigned int e_cnt;
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        GLenum e_type = GL_UNSIGNED_INT;
+        // split streams: one buffer per attribute, VBO_id is the first
+        std::vector<unsigned int> stream_ids;
+        // depth stream: attribute 0 (the position) tightly packed in
+        // pos_VBO_id and a VAO binding only that, 0 without one
+        unsigned int depth_VAO_id = 0, pos_VBO_id = 0;
 
         vertex_array_obj(unsigned int vertex_num, std::initializer_list<unsigned int> vertex_div, float* vertex_data,
                             unsigned int element_num, unsigned int* element_data, 
                             GLenum buffer_usage);
+        // welded vertices and their indices, 16 bit ones when they fit.
+        // depth_stream also copies the positions out for depth only passes.
+        vertex_array_obj(const indexed_mesh &mesh, GLenum buffer_usage, bool depth_stream = false);
+        // same with quantized attributes, see quantize_mesh()
+        vertex_array_obj(const packed_mesh &mesh, GLenum buffer_usage, bool depth_stream = false);
+        // attribute i at location i. One interleaved stream of stride bytes,
+        // or with stride 0 one tightly packed stream per attribute. No
+        // element buffer without indices. See vertex_layout.h for the typed
+        // way to get here. Split streams always get the depth VAO, it reads
+        // the position stream they already have.
+        vertex_array_obj(const std::vector<vertex_attrib> &attribs, unsigned int stride,
+                            std::initializer_list<const void*> streams, unsigned int vertex_num,
+                            const std::vector<unsigned int> &indices, GLenum buffer_usage,
+                            bool depth_stream = false);
         ~vertex_array_obj();
         void draw_array(GLenum draw_mode, int beg, int num);
         void draw_element(GLenum draw_mode, int num);
+
+        // Per instance attributes, stepped once per instance, from location
+        // first_location on. A float attribute of 16 components is a mat4 and
+        // takes 4 locations. The depth VAO gets them too. Returns the stream
+        // index for update_instances().
+        unsigned int add_instance_stream(const std::vector<vertex_attrib> &attribs, unsigned int stride,
+                                            const void* instance_data, unsigned int instance_num,
+                                            unsigned int first_location, GLenum buffer_usage);
+        // new contents of a stream, the old storage is orphaned
+        void update_instances(unsigned int stream, const void* instance_data, unsigned int instance_num);
+        void draw_array_instanced(GLenum draw_mode, int beg, int num, int instance_num);
+        void draw_element_instanced(GLenum draw_mode, int num, int instance_num);
+
+        // Depth only pass, for a pre pass or shadow map: color writes are
+        // off and every draw until end_depth_pass() fetches positions only
+        // from arrays that have a depth stream. The shader may only read
+        // location 0.
+        static void begin_depth_pass();
+        static void end_depth_pass();
+    private:
+        static bool depth_pass;
+
+        struct instance_stream{
+            unsigned int buffer_id, stride;
+            GLenum usage;
+        };
+        std::vector<instance_stream> instance_streams;
+
+        // VAO of the current pass
+        unsigned int pass_array() const;
+        // depth VAO over positions, tightly packed, NULL reads stream_ids[0]
+        void create_depth_array(const vertex_attrib &position, const void* positions, GLenum buffer_usage);
+        // tightly packed float attributes 0, 1, ... of the bound array buffer
+        static void set_float_attributes(const unsigned int* vertex_div, unsigned int div_cnt);
+        // element buffer of e_type indices
+        void upload_indices(const std::vector<unsigned int> &indices, GLenum buffer_usage);
+};
+
+// Vertices the CPU rewrites every frame: particles, debug lines, UI. Like
+// uniform_ring_obj the buffer holds frame_cnt regions, the GPU reads one
+// while the CPU fills the next. Vertices are interleaved, stride bytes each.
+//     stream.begin_frame();
+//     unsigned int first = stream.push(vertices, n);
+//     stream.upload();
+//     stream.draw_array(GL_LINES, first, n);
+//     stream.end_frame();
+class dynamic_vertex_stream{
+    public:
+        enum method{
+            // no fences, the whole buffer is orphaned when the ring wraps
+            ORPHAN,
+            // the region is mapped unsynchronized, a fence per region
+            UNSYNCHRONIZED,
+            // mapped once for good with ARB_buffer_storage (core in 4.4),
+            // a fence per region, UNSYNCHRONIZED without the extension
+            PERSISTENT
+        };
+        unsigned int VAO_id, VBO_id;
+        // bytes of a vertex and of one region, a whole number of vertices
+        unsigned int stride, frame_size, frame_cnt;
+        method mode;
+
+        dynamic_vertex_stream(const std::vector<vertex_attrib> &attribs, unsigned int stride_, unsigned int frame_size_,
+                                unsigned int frame_cnt_ = 3, method mode_ = PERSISTENT);
+        ~dynamic_vertex_stream();
+
+        // waits until the next region is no longer read by the GPU and maps it
+        void begin_frame();
+        // room for vertex_num vertices, first is the vertex to draw them
+        // from. NULL when the region is full or already uploaded
+        void* alloc(unsigned int vertex_num, unsigned int &first);
+        // returns the first vertex of the copy, or -1 (as unsigned)
+        template<typename T>
+        unsigned int push(const T* vertices, unsigned int vertex_num){
+            if(sizeof(T) != stride){
+                printf("[Buffer ERROR] Vertex of %zu bytes pushed to a stream of stride %u\n", sizeof(T), stride);
+                return (unsigned int)-1;
+            }
+            unsigned int first;
+            void* dst = alloc(vertex_num, first);
+            if(dst == NULL)
+                return (unsigned int)-1;
+            memcpy(dst, vertices, sizeof(T) * vertex_num);
+            return first;
+        }
+        // hands this frame's vertices to the GPU, before the draws
+        void upload();
+        void draw_array(GLenum draw_mode, unsigned int first, unsigned int num);
+        // fences the region used by this frame
+        void end_frame();
+    private:
+        std::vector<GLsync> fences;
+        // whole buffer when persistent, NULL otherwise
+        unsigned char* mapped;
+        // where this frame's region is mapped, NULL when it is not
+        unsigned char* region;
+        unsigned int frame_idx, used;
+
+        // creates and binds VBO_id for mode, false when it can not be mapped
+        bool create_buffer();
+};
+
+// Scene wide per object data in a GL_TEXTURE_BUFFER of RGBA32F texels,
+// read by shaders through object_table.glsl. Row i holds object i:
+//     texels 0-3  model matrix columns, with the quantized position decode
+//     texels 4-6  normal matrix columns in xyz, the material id in 4.w
+// The rows are written on the CPU and uploaded at once per frame. A draw
+// sets object_base to the row of its first instance, gl_InstanceID picks
+// the rest, so draws of different meshes need no Object block.
+//     table.clear();
+//     unsigned int a = table.add(model_a, 0), b = table.add(model_b, 1);
+//     table.upload();
+//     table.blind(pos);  shader.set_int(base_h, a); draw...
+class object_table_obj{
+    public:
+        static const unsigned int texels_per_object = 7;
+        unsigned int texture_id, buffer_id;
+        // objects the buffer holds before upload() grows it
+        unsigned int capacity;
+
+        object_table_obj(unsigned int capacity_ = 1024);
+        ~object_table_obj();
+
+        void clear();
+        // returns the row of the object. pos_scale and pos_offset are those
+        // of a packed_mesh, folded into the model matrix
+        unsigned int add(const glm::mat4 &model, unsigned int material_id,
+                            const glm::vec3 &pos_scale = glm::vec3(1.0f), const glm::vec3 &pos_offset = glm::vec3(0.0f));
+        unsigned int size() const;
+        // every row in one call, orphaning last frame's storage
+        void upload();
+        // remember to use the shader at first
+        void blind(unsigned int pos);
+    private:
+        std::vector<glm::vec4> texels;
+};
+
+// Uniform buffer holding one generated std140 block struct T. upload()
+// copies the whole struct in one call, no per field glUniform.
+template<typename T>
+class uniform_block_obj{
+    public:
+        unsigned int ubo_id = 0;
+        T data;
+
+        // creates the buffer on first use, so it can live before the GL context
+        void upload(){
+            if(ubo_id == 0){
+                glGenBuffers(1, &ubo_id);
+                glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+                glBufferData(GL_UNIFORM_BUFFER, sizeof(T), NULL, GL_DYNAMIC_DRAW);
+            }
+            unsigned int binding = uniform_block_binding(T::block_name);
+            if(binding != (unsigned int)-1)
+                glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo_id);
+            else
+                glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+        }
 };
 
 class camera_obj{
@@ -83,6 +512,9 @@ class camera_obj{
         glm::mat4 projection;
         glm::mat4 model;
 
+        // the Camera uniform block of every program
+        uniform_block_obj<camera_block> ubo;
+
         // input key sensitivity
         float sensitivity;
 
@@ -95,7 +527,12 @@ class camera_obj{
         void calc_view();
         void calc_projection();
 
-        void update_shader_uniform(const shader_obj& shader, const char* view_key, const char* proj_key, const char* model_key);
+        void update_shader_uniform(shader_obj& shader, const char* view_key, const char* proj_key, const char* model_key);
+        void update_shader_uniform(shader_obj& shader, uniform_handle view_h, uniform_handle proj_h, uniform_handle model_h);
+        // only the object transform, view and projection come from the Camera block
+        void update_shader_uniform(shader_obj& shader, uniform_handle model_h);
+        // upload the Camera block once per frame
+        void update_uniform_buffer(float time);
         
         void change_pos(enum dir move_dir, float step);
         void change_pitch_yaw(float x_offset, float y_offset);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+
+// Low mip embedded in an image header by tex_preview, shown by
+// texture_loader before the full image is decoded:
+//     PNG:  ancillary private chunk "rcPv" right after IHDR
+//     JPEG: APP15 segment after SOI and any APP0/APP1, starting with "RCPV\0"
+// Decoders skip both. The payload is a preview_header and the pixels, rows
+// bottom up like every texture here, sides at most preview_max_side.
+struct preview_header{
+    unsigned char width, height, channels, reserved;
+};
+
+static const unsigned int preview_max_side = 32;
+static const unsigned char preview_png_type[4] = {'r', 'c', 'P', 'v'};
+static const unsigned char preview_jpeg_id[5] = {'R', 'C', 'P', 'V', 0};
+static const unsigned char preview_jpeg_marker = 0xEF;
+
+inline unsigned int preview_read_be32(const unsigned char* p){
+    return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+}
+
+// payload of the preview in a whole PNG or JPEG file, NULL when there is
+// none, only the chunks before the image data are read
+inline const unsigned char* preview_find(const unsigned char* data, size_t size, size_t &payload_size){
+    static const unsigned char png_sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if(size >= 8 && std::equal(png_sig, png_sig + 8, data)){
+        for(size_t pos=8; pos+12<=size; ){
+            unsigned int len = preview_read_be32(data + pos);
+            const unsigned char* type = data + pos + 4;
+            if(len > size - pos - 12 || std::equal(type, type + 4, (const unsigned char*)"IDAT"))
+                return NULL;
+            if(std::equal(type, type + 4, preview_png_type)){
+                payload_size = len;
+                return data + pos + 8;
+            }
+            pos += 12 + (size_t)len;
+        }
+        return NULL;
+    }
+    if(size >= 2 && data[0] == 0xFF && data[1] == 0xD8){
+        for(size_t pos=2; pos+4<=size && data[pos]==0xFF; ){
+            unsigned char marker = data[pos + 1];
+            // start of scan, no more header segments
+            if(marker == 0xDA)
+                return NULL;
+            size_t len = (size_t)data[pos + 2] << 8 | data[pos + 3];
+            if(len < 2 || pos + 2 + len > size)
+                return NULL;
+            if(marker == preview_jpeg_marker && len >= 2 + sizeof(preview_jpeg_id)
+               && std::equal(preview_jpeg_id, preview_jpeg_id + sizeof(preview_jpeg_id), data + pos + 4)){
+                payload_size = len - 2 - sizeof(preview_jpeg_id);
+                return data + pos + 4 + sizeof(preview_jpeg_id);
+            }
+            pos += 2 + len;
+        }
+    }
+    return NULL;
+}
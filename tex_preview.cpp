@@ -0,0 +1,151 @@
+// Embeds a low mip into a PNG or JPEG header for texture_loader to show
+// before the full image is decoded, see preview_format.h.
+//
+//     tex_preview <image> [out] [side]
+//
+// Without out the image is rewritten in place, an older preview is replaced.
+// side is the longest side of the preview, at most 32.
+#include "preview_format.h"
+#include "mipmap_gen.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+static unsigned int crc32(const unsigned char* data, size_t size, unsigned int crc = 0){
+    crc = ~crc;
+    for(size_t i=0; i<size; i++){
+        crc ^= data[i];
+        for(int k=0; k<8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void put_be32(std::vector<unsigned char> &out, unsigned int val){
+    out.push_back(val >> 24);
+    out.push_back(val >> 16);
+    out.push_back(val >> 8);
+    out.push_back(val);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        printf("usage: %s <image> [out] [side]\n", argv[0]);
+        return 1;
+    }
+    const char* out_name = argc > 2 ? argv[2] : argv[1];
+    unsigned int side = argc > 3 ? atoi(argv[3]) : preview_max_side;
+    if(side < 1 || side > preview_max_side){
+        printf("[Preview ERROR] Side %u is not in 1..%u\n", side, preview_max_side);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(in == NULL){
+        printf("[File ERROR] Fail to load %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<unsigned char> file;
+    unsigned char buf[65536];
+    size_t got;
+    while((got = fread(buf, 1, sizeof(buf), in)) > 0)
+        file.insert(file.end(), buf, buf + got);
+    fclose(in);
+    bool png = file.size() >= 8 && file[0] == 0x89 && file[1] == 'P';
+    bool jpeg = file.size() >= 2 && file[0] == 0xFF && file[1] == 0xD8;
+    if(!png && !jpeg){
+        printf("[Preview ERROR] %s is neither PNG nor JPEG\n", argv[1]);
+        return 1;
+    }
+
+    // same orientation as the loaders
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, ch;
+    unsigned char* data = stbi_load_from_memory(file.data(), file.size(), &width, &height, &ch, 0);
+    if(data == NULL){
+        printf("[File ERROR] Fail to decode %s\n", argv[1]);
+        return 1;
+    }
+    mip_options opt;
+    opt.srgb = ch >= 3;
+    mip_chain mips = build_mip_chain(data, width, height, ch, opt);
+    preview_header h = {0, 0, (unsigned char)ch, 0};
+    const unsigned char* pixels = data;
+    for(const mip_level &mip : mips.levels)
+        if((unsigned int)width > side || (unsigned int)height > side){
+            width = mip.width;
+            height = mip.height;
+            pixels = mip.pixels.data();
+        }
+    h.width = width;
+    h.height = height;
+    std::vector<unsigned char> payload((unsigned char*)&h, (unsigned char*)&h + sizeof(h));
+    payload.insert(payload.end(), pixels, pixels + (size_t)width * height * ch);
+    stbi_image_free(data);
+
+    std::vector<unsigned char> out;
+    size_t dummy;
+    bool had_preview = preview_find(file.data(), file.size(), dummy) != NULL;
+    if(png){
+        // signature and IHDR, the preview, then every other chunk
+        out.insert(out.end(), file.begin(), file.begin() + 8);
+        for(size_t pos=8; pos+12<=file.size(); ){
+            size_t chunk = 12 + (size_t)preview_read_be32(&file[pos]);
+            const unsigned char* type = &file[pos + 4];
+            if(!std::equal(type, type + 4, preview_png_type))
+                out.insert(out.end(), file.begin() + pos, file.begin() + pos + chunk);
+            if(pos == 8){
+                put_be32(out, payload.size());
+                size_t type_pos = out.size();
+                out.insert(out.end(), preview_png_type, preview_png_type + 4);
+                out.insert(out.end(), payload.begin(), payload.end());
+                put_be32(out, crc32(&out[type_pos], out.size() - type_pos));
+            }
+            pos += chunk;
+        }
+    }else{
+        // SOI and the leading APP0 (JFIF) / APP1 (Exif) segments, readers
+        // expect them first, then the preview and the other header
+        // segments, an older preview is dropped wherever it is
+        out.insert(out.end(), file.begin(), file.begin() + 2);
+        bool inserted = false;
+        size_t pos = 2;
+        for(;;){
+            bool header = pos + 4 <= file.size() && file[pos] == 0xFF && file[pos + 1] != 0xDA;
+            size_t seg = header ? 2 + ((size_t)file[pos + 2] << 8 | file[pos + 3]) : 0;
+            if(header && file[pos + 1] == preview_jpeg_marker
+               && std::equal(preview_jpeg_id, preview_jpeg_id + sizeof(preview_jpeg_id), &file[pos + 4])){
+                pos += seg;
+                continue;
+            }
+            if(!inserted && (!header || (file[pos + 1] != 0xE0 && file[pos + 1] != 0xE1))){
+                size_t len = 2 + sizeof(preview_jpeg_id) + payload.size();
+                out.push_back(0xFF);
+                out.push_back(preview_jpeg_marker);
+                out.push_back(len >> 8);
+                out.push_back(len);
+                out.insert(out.end(), preview_jpeg_id, preview_jpeg_id + sizeof(preview_jpeg_id));
+                out.insert(out.end(), payload.begin(), payload.end());
+                inserted = true;
+            }
+            if(!header)
+                break;
+            out.insert(out.end(), file.begin() + pos, file.begin() + pos + seg);
+            pos += seg;
+        }
+        out.insert(out.end(), file.begin() + pos, file.end());
+    }
+
+    FILE* dst = fopen(out_name, "wb");
+    if(dst == NULL){
+        printf("[File ERROR] Fail to write %s\n", out_name);
+        return 1;
+    }
+    fwrite(out.data(), out.size(), 1, dst);
+    fclose(dst);
+    printf("[OK] %s %d*%d %dchs preview of %zu bytes %s\n", out_name, height, width, ch, payload.size(),
+           had_preview ? "replaced" : "embedded");
+    return 0;
+}
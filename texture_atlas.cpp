@@ -0,0 +1,258 @@
+#include "texture_atlas.h"
+#include "mipmap_gen.h"
+#include "stb_image.h"
+#include <climits>
+#include <cstring>
+#include <algorithm>
+
+static const GLenum channel_formats[] = {GL_RED, GL_RED, GL_RG, GL_RGB, GL_RGBA};
+
+maxrects_packer::maxrects_packer(int width_, int height_):width(width_), height(height_){
+    free_rects.push_back(rect{0, 0, width, height});
+}
+
+bool maxrects_packer::insert(int w, int h, int &x, int &y){
+    // the free rect leaving the smallest short side wins
+    int best = -1, best_short = INT_MAX, best_long = INT_MAX;
+    for(unsigned int i=0; i<free_rects.size(); i++){
+        const rect &fr = free_rects[i];
+        if(fr.w < w || fr.h < h)
+            continue;
+        int left_w = fr.w - w, left_h = fr.h - h;
+        int short_side = std::min(left_w, left_h), long_side = std::max(left_w, left_h);
+        if(short_side < best_short || (short_side == best_short && long_side < best_long)){
+            best = i;
+            best_short = short_side;
+            best_long = long_side;
+        }
+    }
+    if(best < 0)
+        return false;
+    rect used = {free_rects[best].x, free_rects[best].y, w, h};
+
+    // every free rect hit by the new one leaves up to 4 maximal pieces
+    std::vector<rect> next;
+    for(const rect &fr : free_rects){
+        if(used.x >= fr.x + fr.w || used.x + used.w <= fr.x || used.y >= fr.y + fr.h || used.y + used.h <= fr.y){
+            next.push_back(fr);
+            continue;
+        }
+        if(used.x > fr.x)
+            next.push_back(rect{fr.x, fr.y, used.x - fr.x, fr.h});
+        if(used.x + used.w < fr.x + fr.w)
+            next.push_back(rect{used.x + used.w, fr.y, fr.x + fr.w - used.x - used.w, fr.h});
+        if(used.y > fr.y)
+            next.push_back(rect{fr.x, fr.y, fr.w, used.y - fr.y});
+        if(used.y + used.h < fr.y + fr.h)
+            next.push_back(rect{fr.x, used.y + used.h, fr.w, fr.y + fr.h - used.y - used.h});
+    }
+    // drop rects contained in another one
+    free_rects.clear();
+    for(unsigned int i=0; i<next.size(); i++){
+        bool contained = false;
+        for(unsigned int j=0; j<next.size() && !contained; j++){
+            if(i == j)
+                continue;
+            const rect &a = next[i], &b = next[j];
+            bool inside = a.x >= b.x && a.y >= b.y && a.x + a.w <= b.x + b.w && a.y + a.h <= b.y + b.h;
+            // of two equal rects keep the first
+            bool equal = a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+            contained = inside && (!equal || j < i);
+        }
+        if(!contained)
+            free_rects.push_back(next[i]);
+    }
+
+    used_area += (long long)w * h;
+    x = used.x;
+    y = used.y;
+    return true;
+}
+
+float maxrects_packer::occupancy() const{
+    return (float)used_area / ((long long)width * height);
+}
+
+texture_array_obj::texture_array_obj(const std::vector<std::string> &file_names, int channels_, int page_size, int safe_levels)
+                    :channels(channels_){
+    struct image_info{
+        int w, h, x, y, layer;
+    };
+    std::vector<image_info> infos(file_names.size());
+    bool same_size = true;
+    int first = -1;
+    for(unsigned int i=0; i<file_names.size(); i++){
+        image_info &info = infos[i];
+        int ch;
+        info.layer = -1;
+        if(!stbi_info(file_names[i].c_str(), &info.w, &info.h, &ch)){
+            printf("[File ERROR] Fail to load texture %s.\n", file_names[i].c_str());
+            info.w = info.h = 0;
+            continue;
+        }
+        if(first < 0)
+            first = i;
+        same_size = same_size && infos[first].w == info.w && infos[first].h == info.h;
+    }
+
+    // edge texels around and alignment of every packed rect
+    int pad = same_size ? 0 : 1 << safe_levels;
+    std::vector<maxrects_packer> pages;
+    if(same_size){
+        width = first < 0 ? 1 : infos[first].w;
+        height = first < 0 ? 1 : infos[first].h;
+        for(image_info &info : infos)
+            if(info.w > 0){
+                info.x = info.y = 0;
+                info.layer = layer_cnt++;
+            }
+    }else{
+        width = height = page_size;
+        for(const image_info &info : infos){
+            width = std::max(width, (info.w + 2 * pad + pad - 1) / pad * pad);
+            height = std::max(height, (info.h + 2 * pad + pad - 1) / pad * pad);
+        }
+        // biggest first packs tighter
+        std::vector<unsigned int> order;
+        for(unsigned int i=0; i<infos.size(); i++)
+            if(infos[i].w > 0)
+                order.push_back(i);
+        std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b){
+            return infos[a].w * infos[a].h > infos[b].w * infos[b].h;
+        });
+        for(unsigned int i : order){
+            image_info &info = infos[i];
+            int cell_w = (info.w + 2 * pad + pad - 1) / pad * pad;
+            int cell_h = (info.h + 2 * pad + pad - 1) / pad * pad;
+            for(unsigned int p=0; p<pages.size() && info.layer < 0; p++)
+                if(pages[p].insert(cell_w, cell_h, info.x, info.y))
+                    info.layer = p;
+            if(info.layer < 0){
+                pages.push_back(maxrects_packer(width, height));
+                pages.back().insert(cell_w, cell_h, info.x, info.y);
+                info.layer = pages.size() - 1;
+            }
+        }
+        layer_cnt = pages.size();
+    }
+    if(layer_cnt == 0)
+        layer_cnt = 1;
+
+    // cpu copy of every layer, packed images get their gutters filled
+    size_t layer_bytes = (size_t)width * height * channels;
+    std::vector<unsigned char> layers(layer_bytes * layer_cnt, 0);
+    // per thread, texture_loader workers may be decoding meanwhile
+    stbi_set_flip_vertically_on_load_thread(1);
+    for(unsigned int i=0; i<infos.size(); i++){
+        image_info &info = infos[i];
+        atlas_entry entry = {-1, glm::vec2(1.0f), glm::vec2(0.0f)};
+        int w, h, ch;
+        unsigned char* data = info.layer < 0 ? NULL : stbi_load(file_names[i].c_str(), &w, &h, &ch, channels);
+        if(data != NULL){
+            unsigned char* page = layers.data() + layer_bytes * info.layer;
+            int cell_w = same_size ? w : (w + 2 * pad + pad - 1) / pad * pad;
+            int cell_h = same_size ? h : (h + 2 * pad + pad - 1) / pad * pad;
+            for(int cy=0; cy<cell_h; cy++){
+                int sy = std::min(std::max(cy - pad, 0), h - 1);
+                for(int cx=0; cx<cell_w; cx++){
+                    int sx = std::min(std::max(cx - pad, 0), w - 1);
+                    memcpy(page + ((size_t)(info.y + cy) * width + info.x + cx) * channels,
+                           data + ((size_t)sy * w + sx) * channels, channels);
+                }
+            }
+            entry.layer = info.layer;
+            entry.scale = glm::vec2((float)w / width, (float)h / height);
+            entry.offset = glm::vec2((float)(info.x + pad) / width, (float)(info.y + pad) / height);
+        }
+        stbi_image_free(data);
+        entries.push_back(entry);
+    }
+
+    // packed layers stop at the last level the gutters protect
+    int max_level = 0;
+    while((width >> (max_level + 1)) > 0 || (height >> (max_level + 1)) > 0)
+        max_level++;
+    if(!same_size)
+        max_level = std::min(max_level, safe_levels);
+
+    GLenum format = channel_formats[channels];
+    glGenTextures(1, &texture_id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id);
+    GLenum wrap = same_size ? GL_MIRRORED_REPEAT : GL_CLAMP_TO_EDGE;
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, max_level);
+    for(int level=0; level<=max_level; level++)
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, std::max(1, width >> level), std::max(1, height >> level),
+                     layer_cnt, 0, format, GL_UNSIGNED_BYTE, NULL);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    mip_options opt;
+    opt.srgb = channels >= 3;
+    size_t bytes = 0;
+    for(int layer=0; layer<layer_cnt; layer++){
+        const unsigned char* base = layers.data() + layer_bytes * layer;
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, format, GL_UNSIGNED_BYTE, base);
+        bytes += layer_bytes;
+        mip_chain mips = build_mip_chain(base, width, height, channels, opt);
+        for(int level=1; level<=max_level && level<=(int)mips.levels.size(); level++){
+            const mip_level &mip = mips.levels[level - 1];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, mip.width, mip.height, 1, format, GL_UNSIGNED_BYTE, mip.pixels.data());
+            bytes += mip.pixels.size();
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    texture_obj::bytes_uncompressed += bytes;
+    texture_obj::bytes_stored += bytes;
+
+    float used = 0.0f;
+    for(const maxrects_packer &page : pages)
+        used += page.occupancy() / pages.size();
+    printf("[OK] Texture array %d*%d*%d %dchs, %zu images, %.0f%% of the layers used.\n",
+           height, width, layer_cnt, channels, entries.size(), same_size ? 100.0f : used * 100.0f);
+}
+
+void texture_array_obj::blind(unsigned int pos){
+    glActiveTexture(GL_TEXTURE0+pos);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id);
+}
+
+glm::vec3 texture_array_obj::remap(unsigned int entry, glm::vec2 uv) const{
+    const atlas_entry &e = entries[entry];
+    return glm::vec3(uv * e.scale + e.offset, (float)e.layer);
+}
+
+void texture_array_obj::remap_vertices(unsigned int entry, float* vertices, unsigned int vertex_cnt,
+                                       unsigned int stride, unsigned int uv_offset, int layer_offset) const{
+    for(unsigned int i=0; i<vertex_cnt; i++){
+        float* v = vertices + (size_t)i * stride;
+        glm::vec3 packed = remap(entry, glm::vec2(v[uv_offset], v[uv_offset + 1]));
+        v[uv_offset] = packed.x;
+        v[uv_offset + 1] = packed.y;
+        if(layer_offset >= 0)
+            v[layer_offset] = packed.z;
+    }
+}
+
+texture_array_set::texture_array_set(std::initializer_list<const char*> file_names, int page_size, int safe_levels){
+    // group by channel count, keeping the request order inside each group
+    std::vector<std::string> groups[5];
+    std::vector<location> group_of;
+    for(const char* file_name : file_names){
+        int w, h, ch = 0;
+        if(!stbi_info(file_name, &w, &h, &ch) || ch < 1 || ch > 4)
+            ch = 4;
+        group_of.push_back(location{(unsigned int)ch, (unsigned int)groups[ch].size()});
+        groups[ch].push_back(file_name);
+    }
+    unsigned int array_of[5];
+    for(int ch=1; ch<=4; ch++)
+        if(!groups[ch].empty()){
+            array_of[ch] = arrays.size();
+            arrays.emplace_back(groups[ch], ch, page_size, safe_levels);
+        }
+    for(const location &loc : group_of)
+        locations.push_back(location{array_of[loc.array], loc.entry});
+}
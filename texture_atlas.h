@@ -0,0 +1,71 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include <string>
+
+// MaxRects bin packing with the best short side fit rule
+class maxrects_packer{
+    public:
+        maxrects_packer(int width, int height);
+        // places a w*h rect, false when it doesn't fit anymore
+        bool insert(int w, int h, int &x, int &y);
+        // share of the bin covered by placed rects
+        float occupancy() const;
+    private:
+        struct rect{
+            int x, y, w, h;
+        };
+        int width, height;
+        long long used_area = 0;
+        // maximal free rects, they may overlap
+        std::vector<rect> free_rects;
+};
+
+// where an image ended up inside a texture_array_obj
+struct atlas_entry{
+    // -1 when the image failed to load
+    int layer;
+    // packed uv = uv * scale + offset
+    glm::vec2 scale, offset;
+};
+
+// Images with the same channel count in the layers of one
+// GL_TEXTURE_2D_ARRAY, so draws with different materials share one bind.
+// Images of one size get a layer each and a full mip chain. Mixed sizes are
+// packed by MaxRects into layers of page_size: every rect is aligned to and
+// surrounded by 2^safe_levels texels copied from its edges, so mips up to
+// safe_levels never mix neighbours, and the chain stops there. Packed images
+// can't use repeat wrapping.
+class texture_array_obj{
+    public:
+        unsigned int texture_id = 0;
+        int width = 0, height = 0, layer_cnt = 0, channels = 0;
+        // one per file, in order
+        std::vector<atlas_entry> entries;
+
+        texture_array_obj(const std::vector<std::string> &file_names, int channels, int page_size = 2048, int safe_levels = 4);
+        // remember to use the shader at first, the sampler is a sampler2DArray
+        void blind(unsigned int pos);
+        // packed uv and layer of a uv of one entry
+        glm::vec3 remap(unsigned int entry, glm::vec2 uv) const;
+        // rewrites interleaved float vertices in place: the uv at uv_offset is
+        // moved into the entry's rect and the layer is written at
+        // layer_offset, -1 skips it. Offsets and stride count floats, like
+        // the vertex_div of vertex_array_obj.
+        void remap_vertices(unsigned int entry, float* vertices, unsigned int vertex_cnt,
+                            unsigned int stride, unsigned int uv_offset, int layer_offset = -1) const;
+};
+
+// Sorts images into one texture_array_obj per channel count.
+class texture_array_set{
+    public:
+        struct location{
+            // index into arrays and into that array's entries
+            unsigned int array, entry;
+        };
+        std::vector<texture_array_obj> arrays;
+        // one per file, in order
+        std::vector<location> locations;
+
+        texture_array_set(std::initializer_list<const char*> file_names, int page_size = 2048, int safe_levels = 4);
+};
@@ -0,0 +1,521 @@
+#include "texture_helper.h"
+#include "preview_format.h"
+#include "stb_image.h"
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const GLenum channel_formats[] = {GL_RED, GL_RED, GL_RG, GL_RGB, GL_RGBA};
+
+#ifdef _WIN32
+mapped_file::mapped_file(const char* file_name){
+    file_handle = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file_handle == INVALID_HANDLE_VALUE){
+        file_handle = NULL;
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+        return;
+    mapping = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping == NULL)
+        return;
+    data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(data)
+        size = (size_t)file_size.QuadPart;
+}
+
+mapped_file::~mapped_file(){
+    if(data)
+        UnmapViewOfFile(data);
+    if(mapping)
+        CloseHandle(mapping);
+    if(file_handle)
+        CloseHandle(file_handle);
+}
+#else
+mapped_file::mapped_file(const char* file_name){
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+        void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr != MAP_FAILED){
+            data = (const unsigned char*)ptr;
+            size = st.st_size;
+        }
+    }
+    // the mapping stays valid after close
+    close(fd);
+}
+
+mapped_file::~mapped_file(){
+    if(data)
+        munmap((void*)data, size);
+}
+#endif
+
+// KTX v1 header after the 12 byte identifier
+struct ktx_header{
+    unsigned int endianness;
+    unsigned int gl_type, gl_type_size, gl_format;
+    unsigned int gl_internal_format, gl_base_internal_format;
+    unsigned int pixel_width, pixel_height, pixel_depth;
+    unsigned int array_elements, faces, mipmap_levels;
+    unsigned int key_value_bytes;
+};
+
+static const unsigned char ktx_identifier[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+ktx_obj::ktx_obj(const char* file_name):file(file_name){
+    if(file.data == NULL){
+        printf("[File ERROR] Fail to map %s\n", file_name);
+        return;
+    }
+    ktx_header hdr;
+    if(file.size < sizeof(ktx_identifier) + sizeof(hdr) || memcmp(file.data, ktx_identifier, sizeof(ktx_identifier)) != 0){
+        printf("[File ERROR] %s is not a KTX file\n", file_name);
+        return;
+    }
+    memcpy(&hdr, file.data + sizeof(ktx_identifier), sizeof(hdr));
+    if(hdr.endianness != 0x04030201){
+        printf("[File ERROR] %s has foreign endianness\n", file_name);
+        return;
+    }
+    if(hdr.pixel_height == 0 || hdr.pixel_depth > 1 || hdr.array_elements > 0 || hdr.faces != 1){
+        printf("[File ERROR] %s is not a plain 2D texture\n", file_name);
+        return;
+    }
+    gl_type = hdr.gl_type;
+    gl_format = hdr.gl_format;
+    gl_internal_format = hdr.gl_internal_format;
+    width = hdr.pixel_width;
+    height = hdr.pixel_height;
+
+    // 0 levels asks the loader to generate them, the file holds the base only
+    generate_mipmap = hdr.mipmap_levels == 0;
+    unsigned int level_cnt = generate_mipmap ? 1 : hdr.mipmap_levels;
+    size_t pos = sizeof(ktx_identifier) + sizeof(hdr) + hdr.key_value_bytes;
+    for(unsigned int i=0; i<level_cnt; i++){
+        if(pos + 4 > file.size)
+            break;
+        unsigned int image_size;
+        memcpy(&image_size, file.data + pos, 4);
+        pos += 4;
+        if(pos + image_size > file.size)
+            break;
+        level lv;
+        lv.data = file.data + pos;
+        lv.size = image_size;
+        lv.width = std::max(1u, width >> i);
+        lv.height = std::max(1u, height >> i);
+        levels.push_back(lv);
+        // mip padding
+        pos += (image_size + 3) / 4 * 4;
+    }
+    if(levels.size() != level_cnt){
+        printf("[File ERROR] %s is truncated\n", file_name);
+        levels.clear();
+        return;
+    }
+    valid = true;
+}
+
+void ktx_obj::upload() const{
+    if(!valid)
+        return;
+    for(unsigned int i=0; i<levels.size(); i++){
+        const level &lv = levels[i];
+        if(gl_type == 0)
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, gl_internal_format, lv.width, lv.height, 0, lv.size, lv.data);
+        else
+            glTexImage2D(GL_TEXTURE_2D, i, gl_internal_format, lv.width, lv.height, 0, gl_format, gl_type, lv.data);
+    }
+    if(generate_mipmap && gl_type != 0)
+        glGenerateMipmap(GL_TEXTURE_2D);
+    else
+        // a partial chain is still complete when sampling stops at the last level
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+}
+
+bool ktx_obj::is_ktx(const char* file_name){
+    size_t len = strlen(file_name);
+    return len >= 4 && (strcmp(file_name + len - 4, ".ktx") == 0 || strcmp(file_name + len - 4, ".KTX") == 0);
+}
+
+GLenum bc_internal_format(bc_format format){
+    switch(format){
+        case BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BC4: return GL_COMPRESSED_RED_RGTC1;
+        default:  return GL_COMPRESSED_RG_RGTC2;
+    }
+}
+
+bool bc_supported(bc_format format){
+    // RGTC is core since 3.0
+    return format == BC4 || format == BC5 || GLAD_GL_EXT_texture_compression_s3tc;
+}
+
+bool texture_handle::ready() const{
+    return target != NULL && target->ready;
+}
+
+unsigned int texture_handle::texture_id() const{
+    return target == NULL ? 0 : target->texture_id;
+}
+
+void texture_handle::blind(unsigned int pos) const{
+    glActiveTexture(GL_TEXTURE0+pos);
+    glBindTexture(GL_TEXTURE_2D, texture_id());
+}
+
+// texture of the preview in the image header, 0 without one, only the
+// first pages of the file are read
+static unsigned int upload_preview(const char* file_name, int &side){
+    mapped_file file(file_name);
+    size_t size = 0;
+    const unsigned char* payload = file.data == NULL ? NULL : preview_find(file.data, file.size, size);
+    if(payload == NULL || size < sizeof(preview_header))
+        return 0;
+    preview_header h;
+    memcpy(&h, payload, sizeof(h));
+    if(h.channels < 1 || h.channels > 4 || size < sizeof(h) + (size_t)h.width * h.height * h.channels)
+        return 0;
+    GLenum format = channel_formats[h.channels];
+    unsigned int texture_id;
+    glGenTextures(1, &texture_id);
+    glBindTexture(GL_TEXTURE_2D, texture_id);
+    texture_obj::set_default_params();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, h.width, h.height, 0, format, GL_UNSIGNED_BYTE, payload + sizeof(h));
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    side = std::max(h.width, h.height);
+    return texture_id;
+}
+
+texture_loader::texture_loader(unsigned int thread_cnt, unsigned int upload_budget)
+                    :done_head(NULL), outstanding(0), region_size((upload_budget + 3) / 4 * 4){
+    if(thread_cnt == 0)
+        thread_cnt = std::thread::hardware_concurrency();
+    if(thread_cnt == 0)
+        thread_cnt = 2;
+    for(unsigned int i=0; i<thread_cnt; i++)
+        workers.emplace_back(&texture_loader::worker_main, this);
+
+    // 1*1 grey until the real image arrives
+    static const unsigned char placeholder[4] = {128, 128, 128, 255};
+    glGenTextures(1, &placeholder_id);
+    glBindTexture(GL_TEXTURE_2D, placeholder_id);
+    texture_obj::set_default_params();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+
+    glGenBuffers(1, &pbo_id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, region_size * region_cnt, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+texture_loader::~texture_loader(){
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        stop = true;
+    }
+    job_cv.notify_all();
+    for(std::thread &t : workers)
+        t.join();
+    take_done();
+    for(decoded* item : uploads){
+        stbi_image_free(item->pixels);
+        delete item;
+    }
+}
+
+texture_handle texture_loader::load(const char* file_name, bool normal_map){
+    slots.push_back(texture_slot{placeholder_id, false});
+    texture_slot* target = &slots.back();
+    texture_handle handle;
+    handle.target = target;
+
+    if(ktx_obj::is_ktx(file_name)){
+        ktx_obj ktx(file_name);
+        if(ktx.valid){
+            glGenTextures(1, &target->texture_id);
+            glBindTexture(GL_TEXTURE_2D, target->texture_id);
+            texture_obj::set_default_params();
+            ktx.upload();
+            target->ready = true;
+            printf("[OK] Texture %s %u*%u %zu levels mapped.\n", file_name, ktx.height, ktx.width, ktx.levels.size());
+        }
+        return handle;
+    }
+
+    // a few KB from the file head, shown until the decode catches up
+    int preview_side = 0;
+    unsigned int preview_id = upload_preview(file_name, preview_side);
+    if(preview_id != 0)
+        target->texture_id = preview_id;
+
+    outstanding++;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        jobs.push_back(job{file_name, target, compress, normal_map, preview_side});
+    }
+    job_cv.notify_one();
+    return handle;
+}
+
+void texture_loader::worker_main(){
+    stbi_set_flip_vertically_on_load_thread(true);
+    while(true){
+        job j;
+        {
+            std::unique_lock<std::mutex> lock(job_mutex);
+            job_cv.wait(lock, [this]{ return stop || !jobs.empty(); });
+            if(stop)
+                return;
+            j = jobs.front();
+            jobs.pop_front();
+        }
+        decoded* item = new decoded;
+        item->target = j.target;
+        item->file_name = j.file_name;
+        item->pixels = stbi_load(j.file_name.c_str(), &item->width, &item->height, &item->channels, 0);
+        if(item->pixels){
+            // this worker is one of many, so no threads of its own
+            mip_options opt;
+            opt.srgb = mip_srgb(item->channels, j.normal_map);
+            opt.thread_cnt = 1;
+            item->mips = build_mip_chain(item->pixels, item->width, item->height, item->channels, opt);
+        }
+        item->format = bc_pick_format(item->channels, j.normal_map);
+        item->compressed = item->pixels != NULL && j.compress && bc_supported(item->format);
+        if(item->compressed){
+            item->blocks.push_back(bc_encode(item->pixels, item->width, item->height, item->channels, item->format, BC_FAST));
+            for(mip_level &mip : item->mips.levels){
+                item->blocks.push_back(bc_encode(mip.pixels.data(), mip.width, mip.height, item->channels, item->format, BC_FAST));
+                // only the sizes are needed from here on
+                std::vector<unsigned char>().swap(mip.pixels);
+            }
+        }
+        item->preview_side = j.preview_side;
+        item->texture_id = 0;
+        // coarsest level first
+        item->level = item->mips.levels.size();
+        item->next_row = 0;
+        item->base_level = item->level + 1;
+        push_done(item);
+    }
+}
+
+void texture_loader::push_done(decoded* item){
+    item->next = done_head.load(std::memory_order_relaxed);
+    while(!done_head.compare_exchange_weak(item->next, item, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+void texture_loader::take_done(){
+    decoded* list = done_head.exchange(NULL, std::memory_order_acquire);
+    // the stack is newest first
+    std::vector<decoded*> items;
+    for(; list != NULL; list = list->next)
+        items.push_back(list);
+    for(auto it = items.rbegin(); it != items.rend(); ++it)
+        uploads.push_back(*it);
+}
+
+unsigned int texture_loader::pump(double budget_ms){
+    take_done();
+    if(uploads.empty())
+        return 0;
+    double end_time = glfwGetTime() + budget_ms / 1000.0;
+
+    // the region was last used region_cnt frames ago, normally long done
+    GLsync &fence = fences[region_idx];
+    if(fence != NULL){
+        while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        fence = NULL;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+    unsigned int region_beg = region_idx * region_size;
+    unsigned char* dst = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, region_beg, region_size,
+                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if(dst == NULL){
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        printf("[Buffer ERROR] Fail to map the pixel unpack ring\n");
+        return 0;
+    }
+
+    // copy rows into the region first, GL reads them after the unmap
+    struct band{
+        decoded* item;
+        int level, row, rows;
+        unsigned int offset;
+    };
+    std::vector<band> bands;
+    unsigned int used = 0;
+    bool region_full = false;
+    for(decoded* item : uploads){
+        if(region_full || (glfwGetTime() >= end_time && !bands.empty()))
+            break;
+        if(item->pixels == NULL)
+            continue;
+        while(item->level >= 0){
+            level_layout lv = get_level(item, item->level);
+            int rows = (region_size - used) / lv.row_bytes;
+            if(rows > lv.row_cnt - item->next_row)
+                rows = lv.row_cnt - item->next_row;
+            if(rows > 0){
+                memcpy(dst + used, lv.data + (size_t)item->next_row * lv.row_bytes, (size_t)rows * lv.row_bytes);
+                bands.push_back(band{item, item->level, item->next_row, rows, region_beg + used});
+                used = (used + rows * lv.row_bytes + 3) / 4 * 4;
+            }else if(used == 0 && lv.row_bytes > region_size){
+                // a single row larger than the region goes straight from client memory
+                rows = lv.row_cnt - item->next_row;
+                bands.push_back(band{item, item->level, item->next_row, rows, 0xFFFFFFFFu});
+            }else{
+                region_full = true;
+                break;
+            }
+            item->next_row += rows;
+            if(item->next_row == lv.row_cnt){
+                item->level--;
+                item->next_row = 0;
+            }
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for(const band &b : bands){
+        decoded* item = b.item;
+        GLenum format = channel_formats[item->channels];
+        GLenum internal_format = item->compressed ? bc_internal_format(item->format) : format;
+        if(item->texture_id == 0){
+            // storage for every level up front, filled band by band
+            glGenTextures(1, &item->texture_id);
+            glBindTexture(GL_TEXTURE_2D, item->texture_id);
+            texture_obj::set_default_params();
+            for(int i=0; i<=(int)item->mips.levels.size(); i++){
+                level_layout lv = get_level(item, i);
+                if(item->compressed)
+                    glCompressedTexImage2D(GL_TEXTURE_2D, i, internal_format, lv.width, lv.height, 0, lv.row_cnt * lv.row_bytes, NULL);
+                else
+                    glTexImage2D(GL_TEXTURE_2D, i, format, lv.width, lv.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, item->mips.levels.size());
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, item->mips.levels.size());
+        }else
+            glBindTexture(GL_TEXTURE_2D, item->texture_id);
+        level_layout lv = get_level(item, b.level);
+        const void* src = (const void*)(size_t)b.offset;
+        if(b.offset == 0xFFFFFFFFu){
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            src = lv.data + (size_t)b.row * lv.row_bytes;
+        }
+        if(item->compressed){
+            // block rows are 4 pixels high, the last one may be cut
+            int y = b.row * 4, height = std::min(b.rows * 4, lv.height - y);
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, b.level, 0, y, lv.width, height, internal_format, b.rows * lv.row_bytes, src);
+        }else
+            glTexSubImage2D(GL_TEXTURE_2D, b.level, 0, b.row, lv.width, b.rows, format, GL_UNSIGNED_BYTE, src);
+        if(b.offset == 0xFFFFFFFFu)
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if(used != 0){
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region_idx = (region_idx + 1) % region_cnt;
+    }
+
+    // sample down to the finest complete level, show it once it is sharper
+    // than the preview
+    for(decoded* item : uploads){
+        if(item->texture_id == 0 || item->base_level == item->level + 1)
+            continue;
+        item->base_level = item->level + 1;
+        glBindTexture(GL_TEXTURE_2D, item->texture_id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, item->base_level);
+        level_layout lv = get_level(item, item->base_level);
+        if(std::max(lv.width, lv.height) > item->preview_side)
+            show(item);
+    }
+
+    unsigned int cnt = 0;
+    while(!uploads.empty()){
+        decoded* item = uploads.front();
+        if(item->pixels != NULL && item->level >= 0)
+            break;
+        uploads.pop_front();
+        finish_upload(item);
+        cnt++;
+    }
+    return cnt;
+}
+
+texture_loader::level_layout texture_loader::get_level(const decoded* item, int level){
+    level_layout lv;
+    if(level == 0){
+        lv.width = item->width;
+        lv.height = item->height;
+        lv.data = item->pixels;
+    }else{
+        const mip_level &mip = item->mips.levels[level - 1];
+        lv.width = mip.width;
+        lv.height = mip.height;
+        lv.data = mip.pixels.data();
+    }
+    if(item->compressed){
+        lv.data = item->blocks[level].data();
+        lv.row_cnt = (lv.height + 3) / 4;
+        lv.row_bytes = (lv.width + 3) / 4 * bc_block_bytes(item->format);
+    }else{
+        lv.row_cnt = lv.height;
+        lv.row_bytes = lv.width * item->channels;
+    }
+    return lv;
+}
+
+void texture_loader::show(decoded* item){
+    texture_slot* target = item->target;
+    if(target->texture_id == item->texture_id)
+        return;
+    // the placeholder is shared, a preview belongs to this texture only
+    if(target->texture_id != placeholder_id)
+        glDeleteTextures(1, &target->texture_id);
+    target->texture_id = item->texture_id;
+}
+
+void texture_loader::finish_upload(decoded* item){
+    if(item->pixels){
+        show(item);
+        item->target->ready = true;
+        for(int i=0; i<=(int)item->mips.levels.size(); i++){
+            level_layout lv = get_level(item, i);
+            texture_obj::bytes_uncompressed += (size_t)lv.width * lv.height * item->channels;
+            texture_obj::bytes_stored += (size_t)lv.row_cnt * lv.row_bytes;
+        }
+        printf("[OK] Texture %s %d*%d %dchs readed.\n", item->file_name.c_str(), item->height, item->width, item->channels);
+    }else
+        printf("[File ERROR] Fail to load texture %s.\n", item->file_name.c_str());
+    stbi_image_free(item->pixels);
+    delete item;
+    outstanding--;
+}
+
+unsigned int texture_loader::pending() const{
+    return outstanding.load();
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include "mipmap_gen.h"
+#include "bc_encoder.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Read only memory map of a whole file, unmapped on destruction
+class mapped_file{
+    public:
+        const unsigned char* data = NULL;
+        size_t size = 0;
+
+        mapped_file(const char* file_name);
+        ~mapped_file();
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+    private:
+#ifdef _WIN32
+        void* file_handle = NULL;
+        void* mapping = NULL;
+#endif
+};
+
+// KTX (v1) container of a 2D texture, read in place from a mapped file.
+// Only native endianness, single face, non array textures are accepted.
+class ktx_obj{
+    public:
+        struct level{
+            const unsigned char* data;
+            unsigned int size, width, height;
+        };
+        // gl_type is 0 for compressed formats
+        unsigned int gl_type, gl_format, gl_internal_format;
+        unsigned int width, height;
+        std::vector<level> levels;
+        // the file holds the base level only and asks for the rest
+        bool generate_mipmap = false;
+        bool valid = false;
+
+        ktx_obj(const char* file_name);
+        // fills the bound GL_TEXTURE_2D with every level in the file
+        void upload() const;
+        // true for a .ktx file name
+        static bool is_ktx(const char* file_name);
+    private:
+        mapped_file file;
+};
+
+// GL internal format of a block compressed format
+GLenum bc_internal_format(bc_format format);
+// BC1/BC3 need S3TC from the driver, BC4/BC5 are core
+bool bc_supported(bc_format format);
+
+// GL side state of a texture requested from texture_loader
+struct texture_slot{
+    // the loader's placeholder until the image is fully uploaded
+    unsigned int texture_id;
+    bool ready;
+};
+
+// Texture requested from texture_loader, shows a placeholder until ready.
+class texture_handle{
+    public:
+        bool ready() const;
+        unsigned int texture_id() const;
+        // remember to use the shader at first
+        void blind(unsigned int pos) const;
+    private:
+        friend class texture_loader;
+        friend class texture_streamer;
+        // owned by the loader, only the GL thread writes it
+        const texture_slot* target = NULL;
+};
+
+// Decodes images and builds their mip chains on worker threads. Finished
+// pixels come back to the GL thread through a lock-free list. pump() copies
+// them level by level into a ring of pixel
+// unpack buffers and starts glTexSubImage2D from there, so the driver never
+// copies from client memory. Each frame uploads at most one ring region of
+// rows, big images are spread over several frames.
+// Levels go up coarse to fine, the texture is shown once it beats the
+// preview embedded by tex_preview (or the grey placeholder) and
+// GL_TEXTURE_BASE_LEVEL follows every finer level completed.
+class texture_loader{
+    public:
+        // 0 threads means one per hardware thread, upload_budget is the
+        // number of bytes uploaded per frame (one PBO region)
+        texture_loader(unsigned int thread_cnt = 0, unsigned int upload_budget = 4 << 20);
+        ~texture_loader();
+
+        // encode textures loaded from now on to BCn on the workers, the
+        // format follows the channel count, see bc_pick_format()
+        bool compress = false;
+
+        // returns at once, the texture shows its embedded preview or a grey
+        // placeholder until the first levels are up,
+        // .ktx files are uploaded right away as they need no decoding.
+        // Compressed normal maps are BC5, the shader rebuilds z.
+        texture_handle load(const char* file_name, bool normal_map = false);
+        // upload finished images until budget_ms or the byte budget is
+        // spent, call once per frame on the GL thread, returns the number
+        // of textures that became ready
+        unsigned int pump(double budget_ms);
+        // requested textures not ready yet
+        unsigned int pending() const;
+    private:
+        struct job{
+            std::string file_name;
+            texture_slot* target;
+            bool compress, normal_map;
+            // longest side of the preview shown meanwhile, 0 without one
+            int preview_side;
+        };
+        // decoded image, pushed by the workers and popped by the GL thread
+        struct decoded{
+            texture_slot* target;
+            std::string file_name;
+            unsigned char* pixels;
+            int width, height, channels;
+            mip_chain mips;
+            // blocks of every level, base first, when compressed
+            bool compressed;
+            bc_format format;
+            std::vector<std::vector<unsigned char>> blocks;
+            int preview_side;
+            // GL thread: texture being filled, level being sent counting
+            // down to 0, rows of it already sent, finest complete level
+            unsigned int texture_id;
+            int level, next_row, base_level;
+            decoded* next;
+        };
+
+        // stable addresses, texture_handle points into this
+        std::deque<texture_slot> slots;
+        unsigned int placeholder_id = 0;
+
+        std::vector<std::thread> workers;
+        std::mutex job_mutex;
+        std::condition_variable job_cv;
+        std::deque<job> jobs;
+        bool stop = false;
+
+        // lock-free stack of finished decodes, the GL thread takes it whole
+        std::atomic<decoded*> done_head;
+        // GL thread side, in the order the decodes finished
+        std::deque<decoded*> uploads;
+        std::atomic<unsigned int> outstanding;
+
+        // pixel unpack ring, one fenced region per frame
+        static const unsigned int region_cnt = 3;
+        unsigned int pbo_id = 0;
+        unsigned int region_size, region_idx = 0;
+        GLsync fences[region_cnt] = {};
+
+        void worker_main();
+        void push_done(decoded* item);
+        // moves everything finished to uploads, first finished first
+        void take_done();
+        // one level as uploaded, rows are pixel rows or rows of 4*4 blocks
+        struct level_layout{
+            const unsigned char* data;
+            int width, height, row_cnt;
+            unsigned int row_bytes;
+        };
+        static level_layout get_level(const decoded* item, int level);
+        // the slot shows the texture being filled from now on
+        void show(decoded* item);
+        // texture is complete, swap it in and free the pixels
+        void finish_upload(decoded* item);
+};
@@ -0,0 +1,292 @@
+#include "texture_streamer.h"
+#include "stb_image.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+static const GLenum channel_formats[] = {GL_RED, GL_RED, GL_RG, GL_RGB, GL_RGBA};
+// levels this size and below are always resident, a few KB per texture
+static const int tail_size = 64;
+
+texture_streamer::texture_streamer(size_t budget_, size_t upload_budget_, size_t pool_budget_)
+                    :budget(budget_), upload_budget(upload_budget_), pool_budget(pool_budget_){
+}
+
+texture_streamer::~texture_streamer(){
+    for(entry &e : entries)
+        stbi_image_free(e.pixels);
+}
+
+const unsigned char* texture_streamer::level_data(const entry &e, int level, int &w, int &h) const{
+    if(level == 0){
+        w = e.width;
+        h = e.height;
+        return e.pixels;
+    }
+    const mip_level &mip = e.mips.levels[level - 1];
+    w = mip.width;
+    h = mip.height;
+    return mip.pixels.data();
+}
+
+size_t texture_streamer::residency_bytes(const entry &e, int first) const{
+    size_t bytes = 0;
+    for(int level=first; level<=e.last; level++){
+        int w, h;
+        level_data(e, level, w, h);
+        bytes += (size_t)w * h * e.channels;
+    }
+    return bytes;
+}
+
+texture_handle texture_streamer::add(const char* file_name){
+    entries.emplace_back();
+    entry &e = entries.back();
+    e.slot.texture_id = 0;
+    e.slot.ready = false;
+    e.file_name = file_name;
+    e.last = e.tail = e.resident = e.wanted = 0;
+    e.lod = std::numeric_limits<float>::infinity();
+    e.needed_frame = frame;
+    e.pending_id = 0;
+    by_slot[&e.slot] = &e;
+    texture_handle handle;
+    handle.target = &e.slot;
+
+    // per thread, texture_loader workers may be decoding meanwhile
+    stbi_set_flip_vertically_on_load_thread(1);
+    e.pixels = stbi_load(file_name, &e.width, &e.height, &e.channels, 0);
+    if(e.pixels == NULL){
+        printf("[File ERROR] Fail to load texture %s.\n", file_name);
+        return handle;
+    }
+    mip_options opt;
+    opt.srgb = e.channels >= 3;
+    e.mips = build_mip_chain(e.pixels, e.width, e.height, e.channels, opt);
+    e.last = e.mips.levels.size();
+    e.tail = e.last;
+    while(e.tail > 0){
+        int w, h;
+        level_data(e, e.tail - 1, w, h);
+        if(std::max(w, h) > tail_size)
+            break;
+        e.tail--;
+    }
+
+    // the tail goes up at once, the texture is never missing
+    e.pending_id = acquire(e, e.tail);
+    e.pending_first = e.tail;
+    e.pending_level = e.last;
+    e.pending_row = 0;
+    size_t unlimited = std::numeric_limits<size_t>::max();
+    fill(e, unlimited);
+    e.slot.texture_id = e.pending_id;
+    e.slot.ready = true;
+    e.resident = e.wanted = e.tail;
+    e.pending_id = 0;
+    printf("[OK] Texture %s %d*%d %dchs streamed, %d levels, %d resident.\n",
+           file_name, e.height, e.width, e.channels, e.last + 1, e.last - e.tail + 1);
+    return handle;
+}
+
+unsigned int texture_streamer::acquire(const entry &e, int first){
+    for(auto it=pool.begin(); it!=pool.end(); it++)
+        if(it->width == e.width && it->height == e.height && it->channels == e.channels
+           && it->first == first && it->last == e.last){
+            unsigned int texture_id = it->texture_id;
+            frame_stats.pool_bytes -= it->bytes;
+            frame_stats.resident_bytes += it->bytes;
+            pool.erase(it);
+            return texture_id;
+        }
+
+    // levels keep their numbers, the finer ones are simply never defined
+    GLenum format = channel_formats[e.channels];
+    unsigned int texture_id;
+    glGenTextures(1, &texture_id);
+    glBindTexture(GL_TEXTURE_2D, texture_id);
+    texture_obj::set_default_params();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, e.last);
+    for(int level=first; level<=e.last; level++){
+        int w, h;
+        level_data(e, level, w, h);
+        glTexImage2D(GL_TEXTURE_2D, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, NULL);
+    }
+    frame_stats.resident_bytes += residency_bytes(e, first);
+    return texture_id;
+}
+
+void texture_streamer::release(const entry &e, unsigned int texture_id, int first){
+    size_t bytes = residency_bytes(e, first);
+    pool.push_back(pooled{texture_id, e.width, e.height, e.channels, first, e.last, bytes});
+    frame_stats.resident_bytes -= bytes;
+    frame_stats.pool_bytes += bytes;
+}
+
+void texture_streamer::drop(entry &e, int first){
+    // levels below the base don't count for completeness, 0*0 frees them
+    GLenum format = channel_formats[e.channels];
+    glBindTexture(GL_TEXTURE_2D, e.slot.texture_id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first);
+    for(int level=e.resident; level<first; level++)
+        glTexImage2D(GL_TEXTURE_2D, level, format, 0, 0, 0, format, GL_UNSIGNED_BYTE, NULL);
+    frame_stats.resident_bytes -= residency_bytes(e, e.resident) - residency_bytes(e, first);
+    frame_stats.dropped += first - e.resident;
+    e.resident = first;
+}
+
+void texture_streamer::trim_pool(size_t max_bytes){
+    while(!pool.empty() && frame_stats.pool_bytes > max_bytes){
+        glDeleteTextures(1, &pool.front().texture_id);
+        frame_stats.pool_bytes -= pool.front().bytes;
+        pool.pop_front();
+    }
+}
+
+bool texture_streamer::fill(entry &e, size_t &budget_left){
+    GLenum format = channel_formats[e.channels];
+    glBindTexture(GL_TEXTURE_2D, e.pending_id);
+    // small levels have rows of any length
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    while(e.pending_level >= e.pending_first && budget_left > 0){
+        int w, h;
+        const unsigned char* data = level_data(e, e.pending_level, w, h);
+        size_t row_bytes = (size_t)w * e.channels;
+        // at least a row, big levels are spread over several frames
+        int rows = (int)std::min<size_t>(h - e.pending_row, std::max<size_t>(budget_left / row_bytes, 1));
+        glTexSubImage2D(GL_TEXTURE_2D, e.pending_level, 0, e.pending_row, w, rows, format, GL_UNSIGNED_BYTE,
+                        data + e.pending_row * row_bytes);
+        size_t bytes = rows * row_bytes;
+        budget_left -= std::min(budget_left, bytes);
+        frame_stats.uploaded += bytes;
+        e.pending_row += rows;
+        if(e.pending_row == h){
+            e.pending_level--;
+            e.pending_row = 0;
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return e.pending_level < e.pending_first;
+}
+
+void texture_streamer::begin_frame(const camera_obj &camera, int screen_h){
+    frame++;
+    camera_pos = camera.position;
+    // projection[1][1] is 1 / tan(fov / 2)
+    pixel_scale = camera.projection[1][1] * screen_h * 0.5f;
+    // near plane back out of a perspective matrix
+    near_plane = camera.projection[3][2] / (camera.projection[2][2] - 1.0f);
+    for(entry &e : entries){
+        e.lod = std::numeric_limits<float>::infinity();
+        e.wanted = e.tail;
+    }
+}
+
+void texture_streamer::use(const texture_handle &texture, const glm::vec3 &center, float radius, float uv_world_size){
+    auto it = by_slot.find(texture.target);
+    if(it == by_slot.end() || it->second->pixels == NULL)
+        return;
+    entry &e = *it->second;
+    // the nearest point of the bounds decides
+    float distance = std::max(glm::length(center - camera_pos) - radius, near_plane);
+    float texels_per_unit = std::max(e.width, e.height) / uv_world_size;
+    float lod = std::log2(texels_per_unit * distance / pixel_scale);
+    e.lod = std::min(e.lod, lod);
+    int level = (int)std::floor(lod) - lod_margin;
+    e.wanted = std::min(e.wanted, std::max(level, 0));
+}
+
+void texture_streamer::update(){
+    frame_stats.uploaded = 0;
+    frame_stats.dropped = 0;
+
+    // finer levels than wanted stay for keep_frames, no thrashing when the
+    // camera goes back and forth
+    std::vector<int> target(entries.size(), 0);
+    size_t total = 0;
+    for(unsigned int i=0; i<entries.size(); i++){
+        entry &e = entries[i];
+        if(e.pixels == NULL)
+            continue;
+        if(e.wanted <= e.resident)
+            e.needed_frame = frame;
+        target[i] = e.wanted;
+        if(target[i] > e.resident && frame - e.needed_frame <= keep_frames)
+            target[i] = e.resident;
+        total += residency_bytes(e, target[i]);
+    }
+    // over budget the level furthest from being seen goes first, unused
+    // textures have an infinite lod and go before anything on screen
+    while(total > budget){
+        int best = -1;
+        float best_gap = std::numeric_limits<float>::infinity();
+        for(unsigned int i=0; i<entries.size(); i++){
+            const entry &e = entries[i];
+            if(e.pixels == NULL || target[i] >= e.tail)
+                continue;
+            float gap = (target[i] + 1) - e.lod;
+            if(best < 0 || gap < best_gap){
+                best = i;
+                best_gap = gap;
+            }
+        }
+        if(best < 0)
+            break;
+        const entry &e = entries[best];
+        total -= residency_bytes(e, target[best]) - residency_bytes(e, target[best] + 1);
+        target[best]++;
+    }
+
+    // drops first as they free memory and cost no upload, then the upgrades
+    // furthest behind
+    std::vector<unsigned int> order;
+    for(unsigned int i=0; i<entries.size(); i++){
+        const entry &e = entries[i];
+        if(e.pixels != NULL && (target[i] != e.resident || e.pending_id != 0))
+            order.push_back(i);
+    }
+    auto priority = [&](unsigned int i){
+        const entry &e = entries[i];
+        return target[i] > e.resident ? std::numeric_limits<float>::max() : e.resident - e.lod;
+    };
+    std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b){
+        return priority(a) > priority(b);
+    });
+    size_t budget_left = upload_budget;
+    for(unsigned int i : order){
+        entry &e = entries[i];
+        if(e.pending_id != 0 && e.pending_first != target[i]){
+            release(e, e.pending_id, e.pending_first);
+            e.pending_id = 0;
+        }
+        if(target[i] == e.resident)
+            continue;
+        if(target[i] > e.resident){
+            drop(e, target[i]);
+            continue;
+        }
+        if(e.pending_id == 0){
+            if(budget_left == 0)
+                continue;
+            e.pending_id = acquire(e, target[i]);
+            e.pending_first = target[i];
+            e.pending_level = e.last;
+            e.pending_row = 0;
+        }
+        if(fill(e, budget_left)){
+            release(e, e.slot.texture_id, e.resident);
+            e.slot.texture_id = e.pending_id;
+            e.resident = target[i];
+            e.pending_id = 0;
+        }
+    }
+
+    frame_stats.pending = 0;
+    for(const entry &e : entries)
+        if(e.pending_id != 0)
+            frame_stats.pending++;
+    size_t room = budget > frame_stats.resident_bytes ? budget - frame_stats.resident_bytes : 0;
+    trim_pool(std::min(room, pool_budget));
+}
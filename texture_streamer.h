@@ -0,0 +1,114 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include "texture_helper.h"
+#include <string>
+#include <unordered_map>
+
+// Keeps only the mips each texture needs on screen in VRAM.
+//   - every frame the objects drawn with a texture report their bounds and
+//     uv density, the finest level asked for follows from the camera
+//     projection: texels per pixel = texels per world unit * distance /
+//     pixels per world unit at distance 1
+//   - a texture holds the levels [first, last] of the full image with
+//     GL_TEXTURE_BASE_LEVEL = first, so level numbers, uvs and the sampler's
+//     lod stay the same whatever is resident
+//   - a finer residency is filled coarse to fine into a second texture, the
+//     shown one is kept until it is complete, so nothing gets blurrier while
+//     it streams in
+//   - a coarser one is done in place: the base level goes up and the levels
+//     below it are redefined as 0*0, no second texture and no upload
+//   - textures replaced by an upgrade go to a pool and are reused by the
+//     next texture asking for the same shape instead of allocating again
+//   - over the VRAM budget the level least needed on screen is dropped first
+// The decoded chain stays in system memory as the streaming source.
+class texture_streamer{
+    public:
+        struct stats{
+            // bytes sent and levels dropped during the last update()
+            size_t uploaded;
+            unsigned int dropped;
+            // textures filling a new residency
+            unsigned int pending;
+            // shown and pending textures, and textures parked in the pool
+            size_t resident_bytes, pool_bytes;
+        };
+        stats frame_stats = {};
+
+        // VRAM for every streamed texture and the pool together
+        size_t budget;
+        // levels finer than needed kept resident, hides the last moment of
+        // an approach and oblique surfaces
+        int lod_margin = 1;
+        // frames a level stays resident after it was last needed
+        unsigned int keep_frames = 120;
+
+        // upload_budget: bytes sent per update(), pool_budget: bytes of
+        // unused textures kept for reuse
+        texture_streamer(size_t budget = 64 << 20, size_t upload_budget = 2 << 20, size_t pool_budget = 8 << 20);
+        ~texture_streamer();
+
+        // decodes the image and uploads its small levels right away
+        texture_handle add(const char* file_name);
+
+        // once per frame before use(), screen_h in pixels
+        void begin_frame(const camera_obj &camera, int screen_h);
+        // for every object drawn with the texture: its world space bounding
+        // sphere and the world length one uv unit covers on it
+        void use(const texture_handle &texture, const glm::vec3 &center, float radius, float uv_world_size);
+        // after the use() calls: picks every residency and uploads within
+        // the byte budget
+        void update();
+    private:
+        struct entry{
+            // texture_handle points here
+            texture_slot slot;
+            std::string file_name;
+            int width, height, channels;
+            unsigned char* pixels;
+            mip_chain mips;
+            // coarsest level and the finest one always resident
+            int last, tail;
+            // finest level of the shown texture
+            int resident;
+            // this frame: smallest lod of the users, finest level wanted
+            float lod;
+            int wanted;
+            // last frame the resident level was needed
+            unsigned int needed_frame;
+            // texture being filled, its finest level, level and row sent next
+            unsigned int pending_id;
+            int pending_first, pending_level, pending_row;
+        };
+        struct pooled{
+            unsigned int texture_id;
+            int width, height, channels, first, last;
+            size_t bytes;
+        };
+
+        // stable addresses for the handles
+        std::deque<entry> entries;
+        std::unordered_map<const texture_slot*, entry*> by_slot;
+        // oldest first
+        std::deque<pooled> pool;
+        size_t upload_budget, pool_budget;
+        unsigned int frame = 0;
+
+        glm::vec3 camera_pos;
+        // pixels one world unit covers at distance 1
+        float pixel_scale = 1.0f;
+        float near_plane = 0.1f;
+
+        const unsigned char* level_data(const entry &e, int level, int &w, int &h) const;
+        // VRAM of the levels [first, last]
+        size_t residency_bytes(const entry &e, int first) const;
+        // texture of levels [first, last], from the pool when one fits
+        unsigned int acquire(const entry &e, int first);
+        void release(const entry &e, unsigned int texture_id, int first);
+        // frees the levels of the shown texture finer than first
+        void drop(entry &e, int first);
+        // deletes pooled textures until the pool holds at most max_bytes
+        void trim_pool(size_t max_bytes);
+        // sends pending rows until budget is spent, true when complete
+        bool fill(entry &e, size_t &budget_left);
+};
@@ -0,0 +1,255 @@
+// Build time generator of C++ structs for std140 uniform blocks.
+//
+//     ubo_codegen <output.h> <shader files...>
+//
+// Every "layout (std140) uniform Name { ... };" found in the shaders becomes
+// "struct name_block" with alignas() so the C++ layout follows std140, plus
+// static_assert checks of every offset computed here from the std140 rules.
+// A block declared in several files must have the same members everywhere.
+#include <cstdio>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <regex>
+
+struct glsl_type{
+    const char* name;
+    // std140 base alignment and size of a single (non array) value
+    unsigned int align, size;
+    // C++ type, and the padded type used for array elements
+    const char* cpp, *cpp_array;
+};
+
+// std140: scalars 4, vec2 8, vec3/vec4 16, matN is an array of N column
+// vectors and every array element is padded to 16 bytes
+static const glsl_type glsl_types[] = {
+    {"float", 4,  4,  "float",            "glm::vec4"},
+    {"int",   4,  4,  "int",              "glm::ivec4"},
+    {"uint",  4,  4,  "unsigned int",     "glm::uvec4"},
+    {"bool",  4,  4,  "int",              "glm::ivec4"},
+    {"vec2",  8,  8,  "glm::vec2",        "glm::vec4"},
+    {"vec3",  16, 12, "glm::vec3",        "glm::vec4"},
+    {"vec4",  16, 16, "glm::vec4",        "glm::vec4"},
+    {"ivec2", 8,  8,  "glm::ivec2",       "glm::ivec4"},
+    {"ivec3", 16, 12, "glm::ivec3",       "glm::ivec4"},
+    {"ivec4", 16, 16, "glm::ivec4",       "glm::ivec4"},
+    {"uvec2", 8,  8,  "glm::uvec2",       "glm::uvec4"},
+    {"uvec3", 16, 12, "glm::uvec3",       "glm::uvec4"},
+    {"uvec4", 16, 16, "glm::uvec4",       "glm::uvec4"},
+    {"bvec2", 8,  8,  "glm::ivec2",       "glm::ivec4"},
+    {"bvec3", 16, 12, "glm::ivec3",       "glm::ivec4"},
+    {"bvec4", 16, 16, "glm::ivec4",       "glm::ivec4"},
+    {"mat2",  16, 32, "glm::mat2x4",      "glm::mat2x4"},
+    {"mat3",  16, 48, "glm::mat3x4",      "glm::mat3x4"},
+    {"mat4",  16, 64, "glm::mat4",        "glm::mat4"},
+};
+
+struct member{
+    const glsl_type* type;
+    std::string name;
+    // 0 for a plain value
+    unsigned int array_cnt;
+    unsigned int offset;
+};
+
+struct block{
+    std::string name;
+    std::vector<member> members;
+    unsigned int size;
+    std::vector<std::string> files;
+};
+
+static const glsl_type* find_type(const std::string &name){
+    for(const glsl_type &t : glsl_types)
+        if(name == t.name)
+            return &t;
+    return NULL;
+}
+
+static unsigned int round_up(unsigned int val, unsigned int align){
+    return (val + align - 1) / align * align;
+}
+
+static std::string strip_comments(const std::string &src){
+    std::string out;
+    for(size_t i=0; i<src.size(); i++){
+        if(src.compare(i, 2, "//") == 0){
+            i = src.find('\n', i);
+            if(i == std::string::npos)
+                break;
+            out += '\n';
+        }else if(src.compare(i, 2, "/*") == 0){
+            i = src.find("*/", i + 2);
+            if(i == std::string::npos)
+                break;
+            i++;
+            out += ' ';
+        }else
+            out += src[i];
+    }
+    return out;
+}
+
+// members are "[precision] type name[, name...] [[N]];"
+static bool parse_members(const std::string &body, const std::string &file, block &blk){
+    static const std::regex decl_re("^\\s*(?:(?:highp|mediump|lowp)\\s+)?(\\w+)\\s+(.+?)\\s*$");
+    static const std::regex name_re("^\\s*(\\w+)\\s*(?:\\[\\s*(\\d+)\\s*\\])?\\s*$");
+    std::stringstream ss(body);
+    std::string decl;
+    unsigned int offset = 0;
+    while(std::getline(ss, decl, ';')){
+        if(decl.find_first_not_of(" \t\r\n") == std::string::npos)
+            continue;
+        std::smatch m;
+        if(!std::regex_match(decl, m, decl_re)){
+            printf("[Codegen ERROR] %s: can't parse \"%s\" in block %s\n", file.c_str(), decl.c_str(), blk.name.c_str());
+            return false;
+        }
+        const glsl_type* type = find_type(m[1]);
+        if(type == NULL){
+            printf("[Codegen ERROR] %s: unsupported type %s in block %s\n", file.c_str(), m[1].str().c_str(), blk.name.c_str());
+            return false;
+        }
+        std::stringstream names(m[2].str());
+        std::string item;
+        while(std::getline(names, item, ',')){
+            std::smatch n;
+            if(!std::regex_match(item, n, name_re)){
+                printf("[Codegen ERROR] %s: can't parse member \"%s\" in block %s\n", file.c_str(), item.c_str(), blk.name.c_str());
+                return false;
+            }
+            member mem;
+            mem.type = type;
+            mem.name = n[1];
+            mem.array_cnt = n[2].matched ? std::stoul(n[2]) : 0;
+            if(mem.array_cnt == 0){
+                offset = round_up(offset, type->align);
+                mem.offset = offset;
+                offset += type->size;
+            }else{
+                unsigned int stride = round_up(type->size, 16);
+                offset = round_up(offset, 16);
+                mem.offset = offset;
+                offset += stride * mem.array_cnt;
+            }
+            blk.members.push_back(mem);
+        }
+    }
+    blk.size = round_up(offset, 16);
+    return true;
+}
+
+static bool same_layout(const block &a, const block &b){
+    if(a.members.size() != b.members.size())
+        return false;
+    for(size_t i=0; i<a.members.size(); i++){
+        const member &x = a.members[i], &y = b.members[i];
+        if(x.type != y.type || x.name != y.name || x.array_cnt != y.array_cnt)
+            return false;
+    }
+    return true;
+}
+
+static std::string struct_name(const std::string &block_name){
+    std::string name;
+    for(size_t i=0; i<block_name.size(); i++){
+        char c = block_name[i];
+        // CameraData -> camera_data
+        if(isupper((unsigned char)c) && i != 0 && !isupper((unsigned char)block_name[i-1]))
+            name += '_';
+        name += (char)tolower((unsigned char)c);
+    }
+    return name + "_block";
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        printf("usage: %s <output.h> <shader files...>\n", argv[0]);
+        return 1;
+    }
+    static const std::regex block_re("layout\\s*\\(([^)]*)\\)\\s*uniform\\s+(\\w+)\\s*\\{([^}]*)\\}\\s*\\w*\\s*;");
+    std::map<std::string, block> blocks;
+    for(int i=2; i<argc; i++){
+        std::ifstream file(argv[i]);
+        if(!file){
+            printf("[Codegen ERROR] Fail to open %s\n", argv[i]);
+            return 1;
+        }
+        std::stringstream stream;
+        stream << file.rdbuf();
+        std::string src = strip_comments(stream.str());
+        std::string path = argv[i];
+        std::string file_name = path.substr(path.find_last_of("/\\") + 1);
+
+        for(std::sregex_iterator it(src.begin(), src.end(), block_re), end; it != end; ++it){
+            const std::smatch &m = *it;
+            block blk;
+            blk.name = m[2];
+            if(m[1].str().find("std140") == std::string::npos){
+                printf("[Codegen WARNING] %s: block %s is not std140, skipped\n", file_name.c_str(), blk.name.c_str());
+                continue;
+            }
+            if(!parse_members(m[3], file_name, blk))
+                return 1;
+            auto found = blocks.find(blk.name);
+            if(found == blocks.end()){
+                blk.files.push_back(file_name);
+                blocks[blk.name] = blk;
+            }else if(!same_layout(found->second, blk)){
+                printf("[Codegen ERROR] Block %s in %s differs from %s\n", blk.name.c_str(), file_name.c_str(), found->second.files[0].c_str());
+                return 1;
+            }else
+                found->second.files.push_back(file_name);
+        }
+    }
+
+    std::stringstream out;
+    out << "// Generated by ubo_codegen from the shader sources, do not edit.\n"
+        << "#pragma once\n\n"
+        << "#include <cstddef>\n"
+        << "#include <glm/glm.hpp>\n";
+    for(const auto &item : blocks){
+        const block &blk = item.second;
+        std::string name = struct_name(blk.name);
+        out << "\n// uniform " << blk.name << ", used by";
+        for(const std::string &f : blk.files)
+            out << ' ' << f;
+        out << "\nstruct " << name << "{\n"
+            << "    static constexpr const char* block_name = \"" << blk.name << "\";\n";
+        for(const member &mem : blk.members){
+            unsigned int align = mem.array_cnt ? 16 : mem.type->align;
+            out << "    alignas(" << align << ") ";
+            if(mem.array_cnt)
+                out << mem.type->cpp_array << ' ' << mem.name << '[' << mem.array_cnt << "];\n";
+            else
+                out << mem.type->cpp << ' ' << mem.name << ";\n";
+        }
+        out << "};\n";
+        for(const member &mem : blk.members)
+            out << "static_assert(offsetof(" << name << ", " << mem.name << ") == " << mem.offset
+                << ", \"std140 offset of " << blk.name << '.' << mem.name << "\");\n";
+        out << "static_assert(sizeof(" << name << ") == " << blk.size
+            << ", \"std140 size of " << blk.name << "\");\n";
+    }
+
+    // leave the header alone when nothing changed, so dependents don't rebuild
+    std::string text = out.str();
+    std::ifstream old(argv[1]);
+    if(old){
+        std::stringstream old_text;
+        old_text << old.rdbuf();
+        if(old_text.str() == text)
+            return 0;
+    }
+    std::ofstream dst(argv[1]);
+    if(!dst){
+        printf("[Codegen ERROR] Fail to write %s\n", argv[1]);
+        return 1;
+    }
+    dst << text;
+    printf("[OK] %zu uniform blocks written to %s\n", blocks.size(), argv[1]);
+    return 0;
+}
@@ -5,11 +5,10 @@ layout (location = 1) in vec2 aTex;
 out vec2 TexCoord;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+#include "camera.glsl"
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    gl_Position = view_projection * model * vec4(aPos, 1.0);
     TexCoord = aTex;
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include "mesh_helper.h"
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <glm/gtc/type_precision.hpp>
+
+// Vertex formats known at compile time:
+//     using lit_layout = vertex_layout<attr<pos, half4>, attr<normal, snorm10_10_10_2>>;
+//     struct lit_vertex{ glm::u16vec4 position; uint32_t normal; };
+//     VERTEX_LAYOUT_CHECK(lit_layout, lit_vertex);
+//     VERTEX_LAYOUT_MEMBER(lit_layout, lit_vertex, 0, position);
+//     VERTEX_LAYOUT_MEMBER(lit_layout, lit_vertex, 1, normal);
+//     vertex_array_obj vao = make_vertex_array<lit_layout>(vertices, indices, GL_STATIC_DRAW);
+// Attribute i is bound to location i. split_layout keeps every attribute in
+// a buffer of its own, see make_split_vertex_array().
+
+// formats: the C++ type of one value, how GL reads it
+#define VERTEX_FORMAT(name, cpp_type, fmt, gl, comps, norm) \
+    struct name{ \
+        using type = cpp_type; \
+        static constexpr attrib_format format = fmt; \
+        static constexpr GLenum gl_type = gl; \
+        static constexpr unsigned int components = comps; \
+        static constexpr bool normalized = norm; \
+    }
+VERTEX_FORMAT(float1, float, ATTRIB_FLOAT, GL_FLOAT, 1, false);
+VERTEX_FORMAT(float2, glm::vec2, ATTRIB_FLOAT, GL_FLOAT, 2, false);
+VERTEX_FORMAT(float3, glm::vec3, ATTRIB_FLOAT, GL_FLOAT, 3, false);
+VERTEX_FORMAT(float4, glm::vec4, ATTRIB_FLOAT, GL_FLOAT, 4, false);
+// 4 locations, per instance only
+VERTEX_FORMAT(float4x4, glm::mat4, ATTRIB_FLOAT, GL_FLOAT, 16, false);
+VERTEX_FORMAT(half2, glm::u16vec2, ATTRIB_HALF, GL_HALF_FLOAT, 2, false);
+VERTEX_FORMAT(half3, glm::u16vec3, ATTRIB_HALF, GL_HALF_FLOAT, 3, false);
+VERTEX_FORMAT(half4, glm::u16vec4, ATTRIB_HALF, GL_HALF_FLOAT, 4, false);
+VERTEX_FORMAT(snorm10_10_10_2, uint32_t, ATTRIB_SNORM_2_10_10_10, GL_INT_2_10_10_10_REV, 4, true);
+VERTEX_FORMAT(unorm8x4, glm::u8vec4, ATTRIB_UNORM8, GL_UNSIGNED_BYTE, 4, true);
+#undef VERTEX_FORMAT
+
+// semantics, the same as quantize_mesh() takes
+struct pos{ static constexpr attrib_usage usage = USAGE_POSITION; };
+struct normal{ static constexpr attrib_usage usage = USAGE_NORMAL; };
+struct tangent{ static constexpr attrib_usage usage = USAGE_TANGENT; };
+struct uv{ static constexpr attrib_usage usage = USAGE_UV; };
+struct color{ static constexpr attrib_usage usage = USAGE_COLOR; };
+struct transform{ static constexpr attrib_usage usage = USAGE_OTHER; };
+
+template<typename Semantic, typename Format>
+struct attr{
+    using semantic = Semantic;
+    using format = Format;
+};
+
+template<bool Split, typename... Attrs>
+struct basic_vertex_layout{
+    static_assert(sizeof...(Attrs) > 0 && sizeof...(Attrs) <= 16, "a layout has 1 to 16 attributes");
+
+    static constexpr bool split = Split;
+    // C++ type of attribute i
+    template<unsigned int I>
+    using type = typename std::tuple_element<I, std::tuple<Attrs...>>::type::format::type;
+
+    static constexpr unsigned int count(){
+        return sizeof...(Attrs);
+    }
+    static constexpr unsigned int size(unsigned int i){
+        constexpr unsigned int sizes[] = {(unsigned int)sizeof(typename Attrs::format::type)...};
+        return sizes[i];
+    }
+    // interleaved attributes start 4 byte aligned
+    static constexpr unsigned int offset(unsigned int i){
+        unsigned int offset = 0;
+        for(unsigned int j=0; j<i && !Split; j++)
+            offset += (size(j) + 3) / 4 * 4;
+        return offset;
+    }
+    // bytes per vertex of the buffer holding attribute i
+    static constexpr unsigned int stride(unsigned int i){
+        return Split ? size(i) : (offset(count() - 1) + size(count() - 1) + 3) / 4 * 4;
+    }
+    static constexpr GLenum gl_type(unsigned int i){
+        constexpr GLenum types[] = {Attrs::format::gl_type...};
+        return types[i];
+    }
+    static constexpr unsigned int components(unsigned int i){
+        constexpr unsigned int comps[] = {Attrs::format::components...};
+        return comps[i];
+    }
+    static constexpr bool normalized(unsigned int i){
+        constexpr bool norms[] = {Attrs::format::normalized...};
+        return norms[i];
+    }
+    // first attribute with the semantic, -1 without one
+    static constexpr int find(attrib_usage usage){
+        constexpr attrib_usage usages[] = {Attrs::semantic::usage...};
+        for(unsigned int i=0; i<count(); i++)
+            if(usages[i] == usage)
+                return i;
+        return -1;
+    }
+
+    // the same as runtime descriptors, for vertex_array_obj
+    static std::vector<vertex_attrib> attribs(){
+        constexpr attrib_format formats[] = {Attrs::format::format...};
+        std::vector<vertex_attrib> result;
+        for(unsigned int i=0; i<count(); i++)
+            result.push_back(vertex_attrib{formats[i], components(i), components(i), offset(i)});
+        return result;
+    }
+};
+
+template<typename... Attrs>
+using vertex_layout = basic_vertex_layout<false, Attrs...>;
+template<typename... Attrs>
+using split_layout = basic_vertex_layout<true, Attrs...>;
+
+// the vertex struct of an interleaved layout has its size, layouts with
+// commas need a using alias first
+#define VERTEX_LAYOUT_CHECK(layout, vertex) \
+    static_assert(!layout::split && sizeof(vertex) == layout::stride(0), #vertex " does not have the size of " #layout)
+// member holds attribute index at its offset with its type
+#define VERTEX_LAYOUT_MEMBER(layout, vertex, index, member) \
+    static_assert(offsetof(vertex, member) == layout::offset(index) \
+                  && std::is_same<decltype(vertex::member), layout::type<index>>::value, \
+                  #vertex "::" #member " is not attribute " #index " of " #layout)
+
+// vertices of an interleaved layout, depth_stream as in vertex_array_obj
+template<typename Layout, typename Vertex>
+vertex_array_obj make_vertex_array(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+                                   GLenum buffer_usage, bool depth_stream = false){
+    static_assert(!Layout::split, "split layouts take one vector per attribute");
+    static_assert(sizeof(Vertex) == Layout::stride(0), "vertex type does not have the size of the layout");
+    return vertex_array_obj(Layout::attribs(), Layout::stride(0), {vertices.data()}, vertices.size(), indices, buffer_usage,
+                            depth_stream);
+}
+
+// per instance data of an interleaved layout, attribute 0 at first_location
+template<typename Layout, typename Instance>
+unsigned int add_instances(vertex_array_obj &vao, const std::vector<Instance> &instances, unsigned int first_location,
+                           GLenum buffer_usage){
+    static_assert(!Layout::split, "instance streams are interleaved");
+    static_assert(sizeof(Instance) == Layout::stride(0), "instance type does not have the size of the layout");
+    return vao.add_instance_stream(Layout::attribs(), Layout::stride(0), instances.data(), instances.size(),
+                                   first_location, buffer_usage);
+}
+
+template<typename Layout, typename... Streams, size_t... I>
+constexpr bool streams_match(std::index_sequence<I...>){
+    bool same[] = {std::is_same<Streams, typename Layout::template type<I>>::value...};
+    for(bool s : same)
+        if(!s)
+            return false;
+    return true;
+}
+
+// one vector per attribute of a split layout, all of the same length
+template<typename Layout, typename... Streams>
+vertex_array_obj make_split_vertex_array(const std::vector<unsigned int> &indices, GLenum buffer_usage,
+                                         const std::vector<Streams>&... streams){
+    static_assert(Layout::split, "interleaved layouts take a vector of vertices");
+    static_assert(sizeof...(Streams) == Layout::count(), "one stream per attribute");
+    static_assert(streams_match<Layout, Streams...>(std::index_sequence_for<Streams...>()),
+                  "stream types do not match the layout");
+    size_t sizes[] = {streams.size()...};
+    return vertex_array_obj(Layout::attribs(), 0, {(const void*)streams.data()...}, sizes[0], indices, buffer_usage);
+}
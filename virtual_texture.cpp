@@ -0,0 +1,321 @@
+#include "virtual_texture.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+// at most this many tiles queued or loading
+static const unsigned int max_requested = 256;
+
+unsigned long long virtual_texture_obj::tile_key(unsigned int level, unsigned int x, unsigned int y){
+    return ((unsigned long long)level << 48) | ((unsigned long long)y << 24) | x;
+}
+
+const unsigned char* virtual_texture_obj::tile_data(unsigned long long key) const{
+    unsigned int level = key >> 48, y = (key >> 24) & 0xFFFFFF, x = key & 0xFFFFFF;
+    return file.data + sizeof(vt_header) + vt_tile_index(header, level, x, y) * vt_tile_bytes(header);
+}
+
+virtual_texture_obj::virtual_texture_obj(const char* file_name, unsigned int cache_side_, unsigned int thread_cnt,
+                                         unsigned int feedback_div_)
+                    :file(file_name), cache_side(cache_side_), feedback_div(std::max(1u, feedback_div_)){
+    if(file.data == NULL || file.size < sizeof(vt_header)){
+        printf("[File ERROR] Fail to map %s\n", file_name);
+        return;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if(header.magic != vt_magic || header.level_cnt == 0 || header.level_cnt > 24 ||
+       file.size < sizeof(vt_header) + vt_tile_index(header, header.level_cnt, 0, 0) * vt_tile_bytes(header)){
+        printf("[File ERROR] %s is not a valid .vtex file\n", file_name);
+        return;
+    }
+
+    unsigned int side = vt_tile_side(header);
+    int max_size = 4096;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    // page table texels hold the slot's x and y in a byte each
+    cache_side = std::max(2u, std::min({cache_side, (unsigned int)max_size / side, 256u}));
+    glGenTextures(1, &cache_id);
+    glBindTexture(GL_TEXTURE_2D, cache_id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cache_side * side, cache_side * side, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glGenTextures(1, &page_table_id);
+    glBindTexture(GL_TEXTURE_2D, page_table_id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.level_cnt - 1);
+    page_levels.resize(header.level_cnt);
+    for(unsigned int level=0; level<header.level_cnt; level++){
+        unsigned int w = vt_level_tiles_x(header, level), h = vt_level_tiles_y(header, level);
+        page_levels[level].assign((size_t)w * h * 4, 0);
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    for(unsigned int slot=cache_side*cache_side; slot>0; slot--)
+        free_slots.push_back(slot - 1);
+    // the top tile backs every lookup and never leaves
+    unsigned long long top = tile_key(header.level_cnt - 1, 0, 0);
+    place_tile(top, tile_data(top));
+    lru.erase(resident[top].lru_it);
+    resident[top].lru_it = lru.end();
+    rebuild_page_table();
+
+    if(thread_cnt == 0)
+        thread_cnt = 1;
+    for(unsigned int i=0; i<thread_cnt; i++)
+        workers.emplace_back(&virtual_texture_obj::worker_main, this);
+    valid = true;
+    printf("[OK] Virtual texture %s %u*%u, %u levels, %u*%u tile cache\n", file_name, header.width, header.height,
+           header.level_cnt, cache_side, cache_side);
+}
+
+virtual_texture_obj::~virtual_texture_obj(){
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        stop = true;
+    }
+    job_cv.notify_all();
+    for(std::thread &t : workers)
+        t.join();
+    for(GLsync fence : readback_fence)
+        if(fence != NULL)
+            glDeleteSync(fence);
+}
+
+void virtual_texture_obj::worker_main(){
+    while(true){
+        unsigned long long key;
+        {
+            std::unique_lock<std::mutex> lock(job_mutex);
+            job_cv.wait(lock, [this]{ return stop || !jobs.empty(); });
+            if(stop)
+                return;
+            key = jobs.front();
+            jobs.pop_front();
+        }
+        // page faults of the mapping happen here, not on the GL thread
+        const unsigned char* src = tile_data(key);
+        loaded_tile tile;
+        tile.key = key;
+        tile.pixels.assign(src, src + vt_tile_bytes(header));
+        std::lock_guard<std::mutex> lock(job_mutex);
+        loaded.push_back(std::move(tile));
+    }
+}
+
+void virtual_texture_obj::blind(shader_obj &shader, unsigned int page_pos, unsigned int cache_pos){
+    glActiveTexture(GL_TEXTURE0+page_pos);
+    glBindTexture(GL_TEXTURE_2D, page_table_id);
+    glActiveTexture(GL_TEXTURE0+cache_pos);
+    glBindTexture(GL_TEXTURE_2D, cache_id);
+    shader.set_int("vt_page_table", page_pos);
+    shader.set_int("vt_cache", cache_pos);
+    shader.set_vec("vt_pages", glm::vec4(header.tiles_x, header.tiles_y, header.level_cnt, header.tile_size));
+    float cache_texels = (float)cache_side * vt_tile_side(header);
+    shader.set_vec("vt_cache_info", glm::vec4(vt_tile_side(header), header.border, 1.0f / cache_texels, 0.0f));
+    shader.set_vec("vt_uv_scale", glm::vec4((float)header.width / (header.tiles_x * header.tile_size),
+                                            (float)header.height / (header.tiles_y * header.tile_size), 0.0f, 0.0f));
+    shader.set_float("vt_lod_bias", 0.0f);
+}
+
+void virtual_texture_obj::blind_feedback(shader_obj &shader){
+    shader.set_vec("vt_pages", glm::vec4(header.tiles_x, header.tiles_y, header.level_cnt, header.tile_size));
+    shader.set_vec("vt_uv_scale", glm::vec4((float)header.width / (header.tiles_x * header.tile_size),
+                                            (float)header.height / (header.tiles_y * header.tile_size), 0.0f, 0.0f));
+    // derivatives are feedback_div times larger in the small target
+    shader.set_float("vt_lod_bias", -log2f((float)feedback_div));
+}
+
+void virtual_texture_obj::begin_feedback(int screen_w, int screen_h){
+    int w = std::max(1, screen_w / (int)feedback_div), h = std::max(1, screen_h / (int)feedback_div);
+    if(feedback_fbo == 0){
+        glGenFramebuffers(1, &feedback_fbo);
+        glGenRenderbuffers(1, &feedback_color);
+        glGenRenderbuffers(1, &feedback_depth);
+    }
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved_fbo);
+    glGetIntegerv(GL_VIEWPORT, saved_viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, feedback_fbo);
+    if(w != feedback_w || h != feedback_h){
+        feedback_w = w;
+        feedback_h = h;
+        glBindRenderbuffer(GL_RENDERBUFFER, feedback_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA16UI, w, h);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedback_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedback_color);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedback_depth);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            printf("[Buffer ERROR] Virtual texture feedback target is incomplete\n");
+    }
+    glViewport(0, 0, w, h);
+    // alpha 0 marks texels nothing was drawn to
+    static const GLuint clear_val[4] = {0, 0, 0, 0};
+    glClearBufferuiv(GL_COLOR, 0, clear_val);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void virtual_texture_obj::end_feedback(){
+    // all readbacks still in flight, skip this one
+    unsigned int idx = readback_next;
+    if(readback_fence[idx] == NULL){
+        if(readback_pbo[idx] == 0)
+            glGenBuffers(1, &readback_pbo[idx]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback_pbo[idx]);
+        if(readback_w[idx] != feedback_w || readback_h[idx] != feedback_h){
+            glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)feedback_w * feedback_h * 8, NULL, GL_STREAM_READ);
+            readback_w[idx] = feedback_w;
+            readback_h[idx] = feedback_h;
+        }
+        glReadPixels(0, 0, feedback_w, feedback_h, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback_fence[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readback_next = (idx + 1) % readback_cnt;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, saved_fbo);
+    glViewport(saved_viewport[0], saved_viewport[1], saved_viewport[2], saved_viewport[3]);
+}
+
+void virtual_texture_obj::read_feedback(){
+    std::unordered_set<unsigned long long> wanted;
+    // oldest first, stop at the first one the GPU hasn't finished
+    for(unsigned int i=0; i<readback_cnt; i++){
+        unsigned int idx = (readback_next + i) % readback_cnt;
+        GLsync &fence = readback_fence[idx];
+        if(fence == NULL)
+            continue;
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if(status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(fence);
+        fence = NULL;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback_pbo[idx]);
+        size_t texel_cnt = (size_t)readback_w[idx] * readback_h[idx];
+        const unsigned short* texels = (const unsigned short*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, texel_cnt * 8, GL_MAP_READ_BIT);
+        if(texels != NULL){
+            for(size_t t=0; t<texel_cnt; t++){
+                const unsigned short* v = texels + t * 4;
+                if(v[3] == 0 || v[2] >= header.level_cnt)
+                    continue;
+                if(v[0] < vt_level_tiles_x(header, v[2]) && v[1] < vt_level_tiles_y(header, v[2]))
+                    wanted.insert(tile_key(v[2], v[0], v[1]));
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    std::vector<unsigned long long> missing;
+    for(unsigned long long key : wanted){
+        auto it = resident.find(key);
+        if(it != resident.end()){
+            it->second.frame = frame;
+            if(it->second.lru_it != lru.end())
+                lru.splice(lru.begin(), lru, it->second.lru_it);
+        }else if(requested.find(key) == requested.end())
+            missing.push_back(key);
+    }
+    // coarse tiles first, they cover the most screen while the rest streams
+    std::sort(missing.begin(), missing.end(), [](unsigned long long a, unsigned long long b){ return a > b; });
+    if(missing.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        for(unsigned long long key : missing){
+            if(requested.size() >= max_requested)
+                break;
+            requested.insert(key);
+            jobs.push_back(key);
+        }
+    }
+    job_cv.notify_all();
+}
+
+bool virtual_texture_obj::place_tile(unsigned long long key, const unsigned char* pixels){
+    unsigned int slot;
+    if(!free_slots.empty()){
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }else{
+        // least recently seen, unless even that one is on screen now
+        if(lru.empty())
+            return false;
+        unsigned long long victim = lru.back();
+        resident_tile &old = resident[victim];
+        if(old.frame == frame)
+            return false;
+        slot = old.slot;
+        lru.pop_back();
+        resident.erase(victim);
+        dirty_level = std::max(dirty_level, (int)(victim >> 48));
+        frame_stats.evicted++;
+    }
+    unsigned int side = vt_tile_side(header);
+    glBindTexture(GL_TEXTURE_2D, cache_id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % cache_side) * side, (slot / cache_side) * side, side, side,
+                    GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    lru.push_front(key);
+    resident[key] = resident_tile{slot, frame, lru.begin()};
+    dirty_level = std::max(dirty_level, (int)(key >> 48));
+    frame_stats.uploaded++;
+    return true;
+}
+
+void virtual_texture_obj::rebuild_page_table(){
+    if(dirty_level < 0)
+        return;
+    glBindTexture(GL_TEXTURE_2D, page_table_id);
+    for(int level=dirty_level; level>=0; level--){
+        unsigned int w = vt_level_tiles_x(header, level), h = vt_level_tiles_y(header, level);
+        std::vector<unsigned char> &texels = page_levels[level];
+        for(unsigned int y=0; y<h; y++)
+            for(unsigned int x=0; x<w; x++){
+                unsigned char* t = &texels[((size_t)y * w + x) * 4];
+                auto it = resident.find(tile_key(level, x, y));
+                if(it != resident.end()){
+                    t[0] = it->second.slot % cache_side;
+                    t[1] = it->second.slot / cache_side;
+                    t[2] = level;
+                    t[3] = 255;
+                }else if(level + 1 < (int)header.level_cnt){
+                    // fall back to the parent, already rebuilt
+                    unsigned int parent_w = vt_level_tiles_x(header, level + 1);
+                    const unsigned char* p = &page_levels[level + 1][((size_t)(y >> 1) * parent_w + (x >> 1)) * 4];
+                    memcpy(t, p, 4);
+                }
+            }
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+    }
+    dirty_level = -1;
+}
+
+void virtual_texture_obj::update(unsigned int upload_budget){
+    if(!valid)
+        return;
+    frame++;
+    frame_stats.uploaded = frame_stats.evicted = 0;
+    read_feedback();
+
+    std::vector<loaded_tile> ready;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        unsigned int cnt = std::min<size_t>(upload_budget, loaded.size());
+        for(unsigned int i=0; i<cnt; i++)
+            ready.push_back(std::move(loaded[i]));
+        loaded.erase(loaded.begin(), loaded.begin() + cnt);
+    }
+    for(loaded_tile &tile : ready){
+        // a full cache of visible tiles drops it, feedback asks again later
+        if(resident.find(tile.key) == resident.end())
+            place_tile(tile.key, tile.pixels.data());
+        requested.erase(tile.key);
+    }
+    rebuild_page_table();
+
+    frame_stats.resident = resident.size();
+    frame_stats.loading = requested.size();
+}
@@ -0,0 +1,56 @@
+// Virtual texture lookups, set up by virtual_texture_obj::blind().
+// Include through shader_library, which expands #include.
+
+// per texel: cache tile x, y, level of that tile, 1 when valid
+uniform sampler2D vt_page_table;
+uniform sampler2D vt_cache;
+// tiles of level 0 per side, level count, content texels per tile
+uniform vec4 vt_pages;
+// tile side with border, border, 1 / cache texels
+uniform vec4 vt_cache_info;
+// share of the virtual size the image covers
+uniform vec4 vt_uv_scale;
+uniform float vt_lod_bias;
+
+// wanted level from the screen space derivatives
+float vt_level(vec2 uv)
+{
+    vec2 texels = uv * vt_pages.xy * vt_pages.w;
+    vec2 dx = dFdx(texels), dy = dFdy(texels);
+    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vt_lod_bias;
+    return clamp(floor(lod), 0.0, vt_pages.z - 1.0);
+}
+
+ivec2 vt_tiles(float level)
+{
+    return max(ivec2(vt_pages.xy) >> int(level), ivec2(1));
+}
+
+vec2 vt_virtual_uv(vec2 uv)
+{
+    return clamp(uv, 0.0, 1.0) * vt_uv_scale.xy;
+}
+
+vec4 vt_sample(vec2 uv)
+{
+    uv = vt_virtual_uv(uv);
+    float level = vt_level(uv);
+    ivec2 tiles = vt_tiles(level);
+    ivec2 page = min(ivec2(uv * vec2(tiles)), tiles - 1);
+    vec4 entry = floor(texelFetch(vt_page_table, page, int(level)) * 255.0 + 0.5);
+    // the entry may point at a coarser tile that is resident
+    vec2 in_tile = min(uv * vec2(vt_tiles(entry.b)), vec2(vt_tiles(entry.b)) - 0.0001);
+    in_tile -= floor(in_tile);
+    vec2 texel = entry.rg * vt_cache_info.x + vt_cache_info.y + in_tile * vt_pages.w;
+    return textureLod(vt_cache, texel * vt_cache_info.z, 0.0);
+}
+
+// tile this fragment wants, alpha 0 in the target means nothing drawn
+uvec4 vt_feedback(vec2 uv)
+{
+    uv = vt_virtual_uv(uv);
+    float level = vt_level(uv);
+    ivec2 tiles = vt_tiles(level);
+    ivec2 page = min(ivec2(uv * vec2(tiles)), tiles - 1);
+    return uvec4(uvec2(page), uint(level), 1u);
+}
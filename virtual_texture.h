@@ -0,0 +1,100 @@
+#pragma once
+
+#include "opengl_helper.h"
+#include "texture_helper.h"
+#include "vt_format.h"
+#include <list>
+#include <unordered_set>
+
+// Virtual texture streamed from a .vtex file (see vt_bake) into a fixed
+// cache of tiles, so VRAM stays the same whatever the image size.
+//   - cache: one RGBA8 texture of cache_side*cache_side tiles, at most
+//     256*256 as the page table addresses a tile with a byte per axis
+//   - page table: RGBA8 texture with a mip per level, every texel holds the
+//     cache tile and level to use, missing tiles point at the nearest coarser
+//     resident one, the single top tile is always resident
+//   - feedback: the scene is drawn with vt_feedback.fs into a small integer
+//     target, read back a few frames later without stalling and turned into
+//     tile requests
+//   - workers copy requested tiles out of the mapped file, update() uploads
+//     a few per frame and evicts the least recently seen ones
+// Shaders sample it through virtual_texture.glsl, see vt_sample.fs.
+class virtual_texture_obj{
+    public:
+        bool valid = false;
+        unsigned int cache_id = 0, page_table_id = 0;
+        vt_header header;
+
+        // tiles per frame, resident and loading at the end of the last update()
+        struct stats{
+            unsigned int uploaded, evicted, resident, loading;
+        };
+        stats frame_stats = {};
+
+        // feedback_div: the feedback target is the screen size divided by this
+        virtual_texture_obj(const char* file_name, unsigned int cache_side = 16, unsigned int thread_cnt = 2,
+                            unsigned int feedback_div = 8);
+        ~virtual_texture_obj();
+
+        // binds the page table and cache and sets the vt_* uniforms
+        void blind(shader_obj &shader, unsigned int page_pos, unsigned int cache_pos);
+        // same for the feedback program, its mip choice is corrected for the
+        // smaller target
+        void blind_feedback(shader_obj &shader);
+        // draw the scene with the feedback program between these two
+        void begin_feedback(int screen_w, int screen_h);
+        void end_feedback();
+        // once per frame on the GL thread: reads finished feedback, queues
+        // tile loads and uploads at most upload_budget tiles
+        void update(unsigned int upload_budget = 4);
+    private:
+        struct resident_tile{
+            unsigned int slot;
+            unsigned int frame;
+            std::list<unsigned long long>::iterator lru_it;
+        };
+        struct loaded_tile{
+            unsigned long long key;
+            std::vector<unsigned char> pixels;
+        };
+
+        mapped_file file;
+        unsigned int cache_side, feedback_div;
+        unsigned int frame = 0;
+
+        // RGBA8 page table of every level on the CPU, rebuilt from the
+        // coarsest changed level down
+        std::vector<std::vector<unsigned char>> page_levels;
+        int dirty_level = -1;
+
+        std::unordered_map<unsigned long long, resident_tile> resident;
+        // most recently seen first, the pinned top tile is not in it
+        std::list<unsigned long long> lru;
+        std::vector<unsigned int> free_slots;
+        // queued or loading
+        std::unordered_set<unsigned long long> requested;
+
+        std::vector<std::thread> workers;
+        std::mutex job_mutex;
+        std::condition_variable job_cv;
+        std::deque<unsigned long long> jobs;
+        std::vector<loaded_tile> loaded;
+        bool stop = false;
+
+        unsigned int feedback_fbo = 0, feedback_color = 0, feedback_depth = 0;
+        int feedback_w = 0, feedback_h = 0;
+        static const unsigned int readback_cnt = 3;
+        unsigned int readback_pbo[readback_cnt] = {};
+        GLsync readback_fence[readback_cnt] = {};
+        int readback_w[readback_cnt] = {}, readback_h[readback_cnt] = {};
+        unsigned int readback_next = 0;
+        int saved_fbo = 0, saved_viewport[4] = {};
+
+        static unsigned long long tile_key(unsigned int level, unsigned int x, unsigned int y);
+        const unsigned char* tile_data(unsigned long long key) const;
+        void worker_main();
+        void read_feedback();
+        // puts a tile into the cache, false when every slot is in use this frame
+        bool place_tile(unsigned long long key, const unsigned char* pixels);
+        void rebuild_page_table();
+};
@@ -0,0 +1,99 @@
+// Cuts an image into the tiled mip pyramid read by virtual_texture_obj.
+//
+//     vt_bake <image> <out.vtex> [tile_size] [border]
+//
+// The image and its mip chain are held in memory while baking, sources
+// bigger than that have to be baked in parts.
+#include "vt_format.h"
+#include "mipmap_gen.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+static unsigned int next_pow2(unsigned int val){
+    unsigned int p = 1;
+    while(p < val)
+        p <<= 1;
+    return p;
+}
+
+int main(int argc, char** argv){
+    if(argc < 3){
+        printf("usage: %s <image> <out.vtex> [tile_size] [border]\n", argv[0]);
+        return 1;
+    }
+    vt_header h;
+    h.magic = vt_magic;
+    h.tile_size = argc > 3 ? atoi(argv[3]) : 128;
+    h.border = argc > 4 ? atoi(argv[4]) : 4;
+    if(h.tile_size < 8 || h.border >= h.tile_size){
+        printf("[Bake ERROR] Bad tile size %u with border %u\n", h.tile_size, h.border);
+        return 1;
+    }
+
+    // same orientation as the other loaders, uv (0, 0) is the bottom left
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, ch;
+    unsigned char* data = stbi_load(argv[1], &width, &height, &ch, 4);
+    if(data == NULL){
+        printf("[File ERROR] Fail to load %s\n", argv[1]);
+        return 1;
+    }
+    h.width = width;
+    h.height = height;
+    h.tiles_x = next_pow2((width + h.tile_size - 1) / h.tile_size);
+    h.tiles_y = next_pow2((height + h.tile_size - 1) / h.tile_size);
+    h.level_cnt = 1;
+    while((h.tiles_x >> (h.level_cnt - 1)) > 1 || (h.tiles_y >> (h.level_cnt - 1)) > 1)
+        h.level_cnt++;
+
+    // level 0 padded to the virtual size by repeating the edge
+    int virtual_w = h.tiles_x * h.tile_size, virtual_h = h.tiles_y * h.tile_size;
+    std::vector<unsigned char> base((size_t)virtual_w * virtual_h * 4);
+    for(int y=0; y<virtual_h; y++)
+        for(int x=0; x<virtual_w; x++){
+            const unsigned char* src = data + ((size_t)std::min(y, height - 1) * width + std::min(x, width - 1)) * 4;
+            std::copy(src, src + 4, &base[((size_t)y * virtual_w + x) * 4]);
+        }
+    stbi_image_free(data);
+    mip_options opt;
+    opt.srgb = true;
+    mip_chain mips = build_mip_chain(base.data(), virtual_w, virtual_h, 4, opt);
+
+    FILE* out = fopen(argv[2], "wb");
+    if(out == NULL){
+        printf("[File ERROR] Fail to write %s\n", argv[2]);
+        return 1;
+    }
+    fwrite(&h, sizeof(h), 1, out);
+    unsigned int side = vt_tile_side(h);
+    std::vector<unsigned char> tile(vt_tile_bytes(h));
+    for(unsigned int level=0; level<h.level_cnt; level++){
+        const unsigned char* pixels = level == 0 ? base.data() : mips.levels[level - 1].pixels.data();
+        int level_w = level == 0 ? virtual_w : mips.levels[level - 1].width;
+        int level_h = level == 0 ? virtual_h : mips.levels[level - 1].height;
+        unsigned int tiles_x = vt_level_tiles_x(h, level), tiles_y = vt_level_tiles_y(h, level);
+        // levels narrower than one tile are stretched over it
+        float scale_x = (float)level_w / (tiles_x * h.tile_size), scale_y = (float)level_h / (tiles_y * h.tile_size);
+        for(unsigned int ty=0; ty<tiles_y; ty++)
+            for(unsigned int tx=0; tx<tiles_x; tx++){
+                for(unsigned int y=0; y<side; y++){
+                    int vy = (int)ty * h.tile_size + (int)y - (int)h.border;
+                    int sy = std::min(std::max((int)(vy * scale_y), 0), level_h - 1);
+                    for(unsigned int x=0; x<side; x++){
+                        int vx = (int)tx * h.tile_size + (int)x - (int)h.border;
+                        int sx = std::min(std::max((int)(vx * scale_x), 0), level_w - 1);
+                        const unsigned char* src = pixels + ((size_t)sy * level_w + sx) * 4;
+                        std::copy(src, src + 4, &tile[((size_t)y * side + x) * 4]);
+                    }
+                }
+                fwrite(tile.data(), tile.size(), 1, out);
+            }
+    }
+    fclose(out);
+    printf("[OK] %s %d*%d baked to %u levels of %u*%u tiles\n", argv[2], height, width, h.level_cnt, h.tiles_y, h.tiles_x);
+    return 0;
+}
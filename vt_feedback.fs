@@ -0,0 +1,11 @@
+#version 330 core
+layout (location = 0) out uvec4 Feedback;
+
+in vec2 TexCoord;
+
+#include "virtual_texture.glsl"
+
+void main()
+{
+    Feedback = vt_feedback(TexCoord);
+}
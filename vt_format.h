@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+
+// .vtex, the tiled mip pyramid read by virtual_texture_obj:
+//     vt_header
+//     RGBA8 tiles of level 0 row by row, then level 1 and so on
+// Tile counts per side are powers of two halving each level down to a single
+// tile. Every tile carries border texels of its neighbours on each side so
+// bilinear filtering never reads another tile of the cache.
+struct vt_header{
+    unsigned int magic;
+    // size of the image, the virtual size is tiles * tile_size
+    unsigned int width, height;
+    // tiles of level 0
+    unsigned int tiles_x, tiles_y;
+    // content texels per tile side and border texels per side
+    unsigned int tile_size, border;
+    unsigned int level_cnt;
+};
+
+static const unsigned int vt_magic = 0x58455456;    // "VTEX"
+
+inline unsigned int vt_tile_side(const vt_header &h){
+    return h.tile_size + 2 * h.border;
+}
+
+inline size_t vt_tile_bytes(const vt_header &h){
+    return (size_t)vt_tile_side(h) * vt_tile_side(h) * 4;
+}
+
+inline unsigned int vt_level_tiles_x(const vt_header &h, unsigned int level){
+    return (h.tiles_x >> level) > 0 ? h.tiles_x >> level : 1;
+}
+
+inline unsigned int vt_level_tiles_y(const vt_header &h, unsigned int level){
+    return (h.tiles_y >> level) > 0 ? h.tiles_y >> level : 1;
+}
+
+// position of a tile in the file, in tiles after the header
+inline size_t vt_tile_index(const vt_header &h, unsigned int level, unsigned int x, unsigned int y){
+    size_t index = 0;
+    for(unsigned int l=0; l<level; l++)
+        index += (size_t)vt_level_tiles_x(h, l) * vt_level_tiles_y(h, l);
+    return index + (size_t)y * vt_level_tiles_x(h, level) + x;
+}
@@ -0,0 +1,11 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+
+#include "virtual_texture.glsl"
+
+void main()
+{
+    FragColor = vt_sample(TexCoord);
+}